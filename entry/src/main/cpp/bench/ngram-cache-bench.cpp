@@ -0,0 +1,136 @@
+// memory, update and load cost of the n-gram cache used for lookup decoding
+//
+// compares the open-addressed common_ngram_cache with the previous design (nested std::unordered_map, one node per
+// n-gram and per following token), on a synthetic token stream with the repetitions of templated output
+
+#include "ngram-cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <unordered_map>
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// counts the bytes allocated by the previous cache
+static size_t n_bytes_legacy = 0;
+
+template <typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    counting_allocator() = default;
+    template <typename U> counting_allocator(const counting_allocator<U> &) {}
+
+    T * allocate(size_t n) {
+        n_bytes_legacy += n*sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T * p, size_t n) {
+        n_bytes_legacy -= n*sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U> bool operator==(const counting_allocator<U> &) const { return true; }
+    template <typename U> bool operator!=(const counting_allocator<U> &) const { return false; }
+};
+
+typedef std::unordered_map<llama_token, int32_t, std::hash<llama_token>, std::equal_to<llama_token>,
+        counting_allocator<std::pair<const llama_token, int32_t>>> legacy_part;
+typedef std::unordered_map<common_ngram, legacy_part, common_ngram_hash_function, std::equal_to<common_ngram>,
+        counting_allocator<std::pair<const common_ngram, legacy_part>>> legacy_cache;
+
+static void legacy_update(legacy_cache & cache, const std::vector<llama_token> & inp) {
+    for (int ngram_size = LLAMA_NGRAM_MIN; ngram_size <= LLAMA_NGRAM_MAX; ++ngram_size) {
+        for (size_t i = ngram_size; i < inp.size(); ++i) {
+            cache[common_ngram(&inp[i - ngram_size], ngram_size)][inp[i]]++;
+        }
+    }
+}
+
+static void legacy_save(const legacy_cache & cache, const std::string & filename) {
+    std::ofstream file_out(filename, std::ios::binary);
+    for (const auto & item : cache) {
+        const int32_t ntokens = item.second.size();
+        file_out.write(reinterpret_cast<const char *>(&item.first), sizeof(common_ngram));
+        file_out.write(reinterpret_cast<const char *>(&ntokens),    sizeof(int32_t));
+        for (const auto & token_count : item.second) {
+            file_out.write(reinterpret_cast<const char *>(&token_count.first),  sizeof(llama_token));
+            file_out.write(reinterpret_cast<const char *>(&token_count.second), sizeof(int32_t));
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+    const size_t n_tokens = argc > 1 ? std::atoll(argv[1]) : 4000000;
+    std::string path = argc > 2 ? argv[2] : "ngram-cache-bench.bin";
+    std::string path_legacy = path + ".legacy";
+
+    // a few hundred templates with random fields, from a 32k vocabulary
+    std::mt19937 rng(42);
+    std::vector<std::vector<llama_token>> templates(256);
+    for (auto & t : templates) {
+        t.resize(16 + rng() % 48);
+        for (auto & token : t) {
+            token = rng() % 32000;
+        }
+    }
+
+    std::vector<llama_token> inp;
+    inp.reserve(n_tokens);
+    while (inp.size() < n_tokens) {
+        for (const llama_token token : templates[rng() % templates.size()]) {
+            inp.push_back(rng() % 8 == 0 ? (llama_token) (rng() % 32000) : token);
+        }
+    }
+    inp.resize(n_tokens);
+
+    printf("%-8s | %10s | %12s | %12s | %10s | %10s\n", "cache", "n-grams", "bytes/n-gram", "update ms", "save ms", "load ms");
+
+    {
+        legacy_cache cache;
+
+        int64_t t0 = now_us();
+        legacy_update(cache, inp);
+        const double t_update = (now_us() - t0) / 1e3;
+        const double n_bytes  = n_bytes_legacy;
+
+        t0 = now_us();
+        legacy_save(cache, path_legacy);
+        const double t_save = (now_us() - t0) / 1e3;
+
+        // the loader converts caches in the previous format
+        t0 = now_us();
+        common_ngram_cache loaded = common_ngram_cache_load(path_legacy);
+        const double t_load = (now_us() - t0) / 1e3;
+
+        printf("%-8s | %10zu | %12.1f | %12.2f | %10.2f | %10.2f\n", "legacy", cache.size(), n_bytes / cache.size(), t_update, t_save, t_load);
+    }
+
+    {
+        common_ngram_cache cache;
+
+        int64_t t0 = now_us();
+        common_ngram_cache_update(cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, inp.size(), false);
+        const double t_update = (now_us() - t0) / 1e3;
+        const double n_bytes  = cache.capacity()*sizeof(common_ngram_entry);
+
+        t0 = now_us();
+        common_ngram_cache_save(cache, path);
+        const double t_save = (now_us() - t0) / 1e3;
+
+        t0 = now_us();
+        common_ngram_cache loaded = common_ngram_cache_load(path);
+        const double t_load = (now_us() - t0) / 1e3;
+
+        printf("%-8s | %10zu | %12.1f | %12.2f | %10.2f | %10.2f\n", "table", cache.size(), n_bytes / cache.size(), t_update, t_save, t_load);
+    }
+
+    std::remove(path.c_str());
+    std::remove(path_legacy.c_str());
+
+    return 0;
+}
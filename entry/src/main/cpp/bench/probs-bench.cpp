@@ -0,0 +1,101 @@
+// cost of the n_probs computation of the server, per generated token
+//
+// compares get_token_probabilities() (max + exp-sum passes and a top-k heap) with the previous implementation, which
+// sorted the whole vocabulary, for vocabulary sizes of common models
+
+#include "../utils.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the previous implementation, on raw logits
+static std::vector<llama_token_data> get_token_probabilities_sort(const float * logits, int n_vocab) {
+    std::vector<llama_token_data> cur;
+
+    cur.resize(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+
+    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    float max_l = cur[0].logit;
+    float cum_sum = 0.0f;
+    for (size_t i = 0; i < cur.size(); ++i) {
+        float p = expf(cur[i].logit - max_l);
+        cur[i].p = p;
+        cum_sum += p;
+    }
+    for (size_t i = 0; i < cur.size(); ++i) {
+        cur[i].p /= cum_sum;
+    }
+
+    return cur;
+}
+
+int main(int argc, char ** argv) {
+    const int n_iter = argc > 1 ? std::atoi(argv[1]) : 100;
+    const int n_top  = argc > 2 ? std::atoi(argv[2]) : 10;
+
+    printf("%9s | %5s | %12s | %12s | %8s\n", "n_vocab", "n_top", "sort us/tok", "top-k us/tok", "speedup");
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    for (const int n_vocab : { 32000, 128000, 256000 }) {
+        std::vector<std::vector<float>> logits(8, std::vector<float>(n_vocab));
+        for (auto & l : logits) {
+            for (auto & x : l) {
+                x = dist(rng);
+            }
+        }
+
+        // check that both implementations agree
+        // the probabilities differ slightly because the exponentials are summed in a different order (the sorted order
+        // of the previous implementation loses more of the small terms)
+        {
+            const auto ref = get_token_probabilities_sort(logits[0].data(), n_vocab);
+
+            std::vector<llama_token_data> cur;
+            const float p = get_token_probabilities(logits[0].data(), n_vocab, ref[n_top].id, n_top, cur);
+
+            bool ok = std::fabs(p - ref[n_top].p) <= 1e-6f + 1e-3f*ref[n_top].p;
+            for (int i = 0; i < n_top; ++i) {
+                ok = ok && cur[i].id == ref[i].id && std::fabs(cur[i].p - ref[i].p) <= 1e-6f + 1e-3f*ref[i].p;
+            }
+
+            if (!ok) {
+                fprintf(stderr, "mismatch at n_vocab = %d\n", n_vocab);
+                return 1;
+            }
+        }
+
+        // keeps the results alive
+        volatile float sink = 0.0f;
+
+        int64_t t_start = now_ns();
+        for (int i = 0; i < n_iter; ++i) {
+            const auto cur = get_token_probabilities_sort(logits[i % logits.size()].data(), n_vocab);
+            sink += cur[0].p;
+        }
+        const double t_sort = (now_ns() - t_start) / 1e3 / n_iter;
+
+        std::vector<llama_token_data> cur;
+
+        t_start = now_ns();
+        for (int i = 0; i < n_iter; ++i) {
+            sink += get_token_probabilities(logits[i % logits.size()].data(), n_vocab, 0, n_top, cur);
+        }
+        const double t_topk = (now_ns() - t_start) / 1e3 / n_iter;
+
+        printf("%9d | %5d | %12.1f | %12.1f | %7.1fx\n", n_vocab, n_top, t_sort, t_topk, t_sort / t_topk);
+    }
+
+    return 0;
+}
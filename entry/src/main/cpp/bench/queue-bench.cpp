@@ -0,0 +1,129 @@
+// post-to-dispatch latency of the server task queue
+//
+// compares the lock-free mpsc_queue used by server_queue with the previous design (std::deque + mutex + condition variable)
+// N producer threads post timestamped tasks, a single consumer drains the queue and waits when it is empty, like server_queue::start_loop()
+
+#include "../utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct bench_task {
+    int64_t t_post;
+};
+
+struct locked_queue {
+    std::deque<bench_task> tasks;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    void push(bench_task task) {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back(task);
+        condition.notify_one();
+    }
+
+    std::optional<bench_task> try_pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (tasks.empty()) {
+            return std::nullopt;
+        }
+        bench_task task = tasks.front();
+        tasks.pop_front();
+        return task;
+    }
+
+    template <typename Pred>
+    void wait(Pred stop) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] {
+            return !tasks.empty() || stop();
+        });
+    }
+
+    void notify(bool) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.notify_all();
+    }
+};
+
+template <typename Q>
+static void run(const char * name, Q & queue, int n_producers, int n_tasks) {
+    std::atomic<int> n_done = 0;
+
+    std::vector<int64_t> latency;
+    latency.reserve(n_tasks);
+
+    std::thread consumer([&] {
+        while ((int) latency.size() < n_tasks) {
+            while (auto task = queue.try_pop()) {
+                latency.push_back(now_ns() - task->t_post);
+            }
+            queue.wait([&] {
+                return n_done == n_producers && (int) latency.size() >= n_tasks;
+            });
+        }
+    });
+
+    const int64_t t_start = now_ns();
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < n_producers; ++i) {
+        producers.emplace_back([&, i] {
+            const int n = n_tasks / n_producers + (i < n_tasks % n_producers ? 1 : 0);
+            for (int j = 0; j < n; ++j) {
+                queue.push({ now_ns() });
+            }
+            n_done++;
+        });
+    }
+
+    for (auto & t : producers) {
+        t.join();
+    }
+    queue.notify(true);
+    consumer.join();
+
+    const double t_total_ms = (now_ns() - t_start) / 1e6;
+
+    std::sort(latency.begin(), latency.end());
+
+    double sum = 0.0;
+    for (const int64_t l : latency) {
+        sum += l;
+    }
+
+    printf("%-8s | %9d | %10.2f | %10.2f | %10.2f | %10.2f | %10.0f\n",
+            name, n_producers,
+            sum / latency.size() / 1e3,
+            latency[latency.size() / 2] / 1e3,
+            latency[latency.size() * 99 / 100] / 1e3,
+            latency.back() / 1e3,
+            n_tasks / t_total_ms * 1e3);
+}
+
+int main(int argc, char ** argv) {
+    const int n_tasks = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    printf("%-8s | %9s | %10s | %10s | %10s | %10s | %10s\n", "queue", "producers", "mean us", "p50 us", "p99 us", "max us", "tasks/s");
+
+    for (const int n_producers : { 1, 8, 64 }) {
+        {
+            mpsc_queue<bench_task> queue(1024);
+            run("mpsc", queue, n_producers, n_tasks);
+        }
+        {
+            locked_queue queue;
+            run("locked", queue, n_producers, n_tasks);
+        }
+    }
+
+    return 0;
+}
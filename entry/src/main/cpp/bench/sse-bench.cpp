@@ -0,0 +1,121 @@
+// CPU time of streaming the generated tokens to a client, per token, with the tokens coalesced into events of 1 to 16
+// tokens (stream_min_tokens)
+//
+// each event is an OAI-compat chat completion chunk written to /dev/null, either built as a JSON object as in
+// server_task_result_cmpl_partial::to_json_oaicompat_chat() and written with server_sent_event(), or written directly
+// into a reused buffer as in server_task_result_cmpl_partial::write_sse_oaicompat_chat(); the two must give the same
+// bytes
+
+#include "../utils.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+static json chat_chunk(const std::string & content) {
+    json choices = json::array({json{
+        {"finish_reason", nullptr},
+        {"index", 0},
+        {"delta",
+        json {
+            {"content", content},
+        }},
+    }});
+
+    return json {
+        {"choices",            choices},
+        {"created",            std::time(0)},
+        {"id",                 "chatcmpl-0123456789abcdef0123456789abcdef"},
+        {"model",              "gpt-3.5-turbo"},
+        {"system_fingerprint", "b0-0000000"},
+        {"object",             "chat.completion.chunk"}
+    };
+}
+
+static void chat_chunk_write(std::string & out, const std::string & content) {
+    out += "data: {\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"content\":";
+    json_write_string(out, content);
+    out += "}}],\"created\":";
+    json_write_int(out, std::time(0));
+    out += ",\"id\":";
+    json_write_string(out, "chatcmpl-0123456789abcdef0123456789abcdef");
+    out += ",\"model\":";
+    json_write_string(out, "gpt-3.5-turbo");
+    out += ",\"system_fingerprint\":";
+    json_write_string(out, "b0-0000000");
+    out += ",\"object\":\"chat.completion.chunk\"}\n\n";
+}
+
+int main(int argc, char ** argv) {
+    const int n_tokens = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    const int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open /dev/null\n");
+        return 1;
+    }
+
+    httplib::DataSink sink;
+    sink.write = [fd](const char * data, size_t size) {
+        return write(fd, data, size) == (ssize_t) size;
+    };
+
+    const std::vector<std::string> pieces = {
+        " the", " meaning", " of", " life", " is", " to", " be", " \"happy\"", ".", "\n", "\t", " caf\xC3\xA9", "\x01", "\\",
+    };
+
+    // the bytes of the two writers
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        std::string out;
+        chat_chunk_write(out, pieces[i] + pieces[(i + 1) % pieces.size()]);
+        const std::string ref = "data: " + chat_chunk(pieces[i] + pieces[(i + 1) % pieces.size()]).dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+        if (out != ref) {
+            fprintf(stderr, "the two writers give different events:\n%s%s", ref.c_str(), out.c_str());
+            return 1;
+        }
+    }
+
+    printf("%10s | %9s | %15s | %15s | %8s\n", "tokens/ev", "events", "json ns/tok", "direct ns/tok", "speedup");
+
+    for (const int n_coalesce : { 1, 2, 4, 8, 16 }) {
+        double t_tok[2];
+
+        int n_events = 0;
+        for (int direct = 0; direct < 2; ++direct) {
+            const std::clock_t t_start = std::clock();
+
+            n_events = 0;
+            std::string content;
+            std::string buf;
+            for (int i = 0; i < n_tokens; ++i) {
+                content += pieces[i % pieces.size()];
+
+                if ((i + 1) % n_coalesce == 0 || i + 1 == n_tokens) {
+                    bool ok;
+                    if (direct) {
+                        buf.clear();
+                        chat_chunk_write(buf, content);
+                        ok = server_sent_events_write(sink, buf);
+                    } else {
+                        ok = server_sent_event(sink, "data", chat_chunk(content));
+                    }
+                    if (!ok) {
+                        fprintf(stderr, "failed to write the event\n");
+                        return 1;
+                    }
+                    content.clear();
+                    n_events++;
+                }
+            }
+
+            t_tok[direct] = 1e9 * (std::clock() - t_start) / CLOCKS_PER_SEC / n_tokens;
+        }
+
+        printf("%10d | %9d | %15.1f | %15.1f | %7.1fx\n", n_coalesce, n_events, t_tok[0], t_tok[1], t_tok[0] / t_tok[1]);
+    }
+
+    close(fd);
+
+    return 0;
+}
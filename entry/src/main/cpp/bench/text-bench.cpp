@@ -0,0 +1,257 @@
+// cost of the text handling of process_token() in the server, per generated token, along a long generation
+//
+// compares the current handling (incremental UTF-8 validation, stop words matched on the new bytes only, new lines
+// searched in the new bytes only, text to send copied once from the unsent region) with the previous one, which
+// searched the unsent text for each stop word and the current line for the next new line on every token
+//
+// the stream is a long JSON document on a single indented line, with a multi-byte character split across tokens from
+// time to time, generated with 4 stop words and n_indent set
+
+#include "../utils.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the state of a slot that is used by the text handling
+struct text_state {
+    std::string generated_text;
+    std::string text_to_send;
+
+    size_t n_sent_text   = 0;
+    size_t last_nl_pos   = 0;
+    size_t n_text_valid  = 0;
+    size_t n_nl_searched = 0;
+
+    bool has_new_line = false;
+    bool stopped      = false;
+
+    stop_string_matcher stop_matcher;
+};
+
+// the previous implementation
+static bool ends_with_prev(const std::string & str, const std::string & suffix) {
+    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+}
+
+static size_t find_partial_stop_string_prev(const std::string & stop, const std::string & text) {
+    if (!text.empty() && !stop.empty()) {
+        const char text_last_char = text.back();
+        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
+            if (stop[char_index] == text_last_char) {
+                const std::string current_partial = stop.substr(0, char_index + 1);
+                if (ends_with_prev(text, current_partial)) {
+                    return text.size() - char_index - 1;
+                }
+            }
+        }
+    }
+
+    return std::string::npos;
+}
+
+static size_t find_stopping_strings_prev(const std::vector<std::string> & words, const std::string & text, size_t last_token_size, bool is_full_stop) {
+    size_t stop_pos = std::string::npos;
+
+    for (const std::string & word : words) {
+        size_t pos;
+
+        if (is_full_stop) {
+            const size_t tmp      = word.size() + last_token_size;
+            const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+
+            pos = text.find(word, from_pos);
+        } else {
+            pos = find_partial_stop_string_prev(word, text);
+        }
+
+        if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
+            stop_pos = pos;
+        }
+    }
+
+    return stop_pos;
+}
+
+static void process_text_prev(text_state & st, const std::vector<std::string> & words, const std::string & piece, int n_indent) {
+    st.text_to_send = piece;
+
+    const std::string token_str = st.text_to_send;
+
+    st.generated_text += token_str;
+
+    const bool incomplete = validate_utf8(st.generated_text) < st.generated_text.size();
+
+    if (!incomplete) {
+        size_t pos = std::min(st.n_sent_text, st.generated_text.size());
+
+        const std::string str_test = st.generated_text.substr(pos);
+        bool send_text = true;
+
+        size_t stop_pos = find_stopping_strings_prev(words, str_test, token_str.size(), true);
+        if (stop_pos != std::string::npos) {
+            st.stopped = true;
+        } else {
+            stop_pos = find_stopping_strings_prev(words, str_test, token_str.size(), false);
+            send_text = stop_pos == std::string::npos;
+        }
+
+        if (send_text) {
+            st.text_to_send = st.generated_text.substr(pos, std::string::npos);
+            st.n_sent_text += st.text_to_send.size();
+        } else {
+            st.text_to_send = "";
+        }
+    }
+
+    if (st.has_new_line && n_indent > 0) {
+        if (st.last_nl_pos > 0) {
+            size_t pos = st.last_nl_pos;
+
+            int n = 0;
+            while (pos < st.generated_text.size() && (st.generated_text[pos] == ' ' || st.generated_text[pos] == '\t')) {
+                n++;
+                pos++;
+            }
+
+            if (pos < st.generated_text.size() && n < n_indent) {
+                st.stopped = true;
+            }
+        }
+
+        const size_t pos = st.generated_text.find('\n', st.last_nl_pos);
+        if (pos != std::string::npos) {
+            st.last_nl_pos = pos + 1;
+        }
+    }
+
+    if (st.text_to_send.find('\n') != std::string::npos) {
+        st.has_new_line = true;
+    }
+}
+
+// the current implementation, as in server_context::process_token()
+static void process_text(text_state & st, const std::string & piece, int n_indent) {
+    st.text_to_send = piece;
+
+    st.generated_text += st.text_to_send;
+
+    st.n_text_valid = validate_utf8(st.generated_text, st.n_text_valid);
+
+    const bool incomplete = st.n_text_valid < st.generated_text.size();
+
+    if (!incomplete) {
+        const size_t pos = std::min(st.n_sent_text, st.generated_text.size());
+
+        bool send_text = true;
+
+        int32_t word = -1;
+
+        size_t stop_pos = st.stop_matcher.feed(st.generated_text, pos, word);
+        if (stop_pos != std::string::npos) {
+            st.stopped = true;
+        } else {
+            stop_pos = st.stop_matcher.find_partial(pos);
+            send_text = stop_pos == std::string::npos;
+        }
+
+        if (send_text) {
+            st.text_to_send.assign(std::string_view(st.generated_text).substr(pos));
+            st.n_sent_text += st.text_to_send.size();
+        } else {
+            st.text_to_send.clear();
+        }
+    }
+
+    if (st.has_new_line && n_indent > 0) {
+        if (st.last_nl_pos > 0) {
+            size_t pos = st.last_nl_pos;
+
+            int n = 0;
+            while (pos < st.generated_text.size() && (st.generated_text[pos] == ' ' || st.generated_text[pos] == '\t')) {
+                n++;
+                pos++;
+            }
+
+            if (pos < st.generated_text.size() && n < n_indent) {
+                st.stopped = true;
+            }
+        }
+
+        const size_t pos = st.generated_text.find('\n', std::max(st.last_nl_pos, st.n_nl_searched));
+        if (pos != std::string::npos) {
+            st.last_nl_pos = pos + 1;
+        }
+
+        st.n_nl_searched = pos != std::string::npos ? pos + 1 : st.generated_text.size();
+    }
+
+    if (st.text_to_send.find('\n') != std::string::npos) {
+        st.has_new_line = true;
+    }
+}
+
+int main(int argc, char ** argv) {
+    const int n_tokens = argc > 1 ? std::atoi(argv[1]) : 8192;
+    const int n_bucket = argc > 2 ? std::atoi(argv[2]) : 1024;
+    const int n_rep    = argc > 3 ? std::atoi(argv[3]) : 20;
+
+    const std::vector<std::string> words = { "</answer>", "\n\n\n", "<|im_end|>", "User:" };
+
+    // the pieces of the stream, "\xC3\xA9" is split across two tokens
+    const std::vector<std::string> pieces = {
+        "{\"", "id", "\":", " ", "42", ",", " \"", "name", "\":", " \"", "caf", "\xC3", "\xA9", "\"", ",", " \"",
+        "tags", "\":", " [", "\"", "a", "\",", " \"", "b", "\"],", " \"", "user", "\":", " \"", "Us", "er", "\"", "},",
+    };
+
+    std::vector<std::string> stream = { "\n", "  " };
+    while ((int) stream.size() < n_tokens) {
+        stream.push_back(pieces[(stream.size() - 2) % pieces.size()]);
+    }
+
+    const int n_buckets = n_tokens / n_bucket;
+
+    std::vector<double> t_prev(n_buckets, 0.0);
+    std::vector<double> t_cur (n_buckets, 0.0);
+
+    for (int r = 0; r < n_rep; ++r) {
+        text_state st_prev;
+        text_state st_cur;
+        st_cur.stop_matcher.init(words);
+
+        std::string sent_prev;
+        std::string sent_cur;
+
+        for (int b = 0; b < n_buckets; ++b) {
+            int64_t t_start = now_ns();
+            for (int i = b*n_bucket; i < (b + 1)*n_bucket; ++i) {
+                process_text_prev(st_prev, words, stream[i], 2);
+                sent_prev += st_prev.text_to_send;
+            }
+            t_prev[b] += now_ns() - t_start;
+
+            t_start = now_ns();
+            for (int i = b*n_bucket; i < (b + 1)*n_bucket; ++i) {
+                process_text(st_cur, stream[i], 2);
+                sent_cur += st_cur.text_to_send;
+            }
+            t_cur[b] += now_ns() - t_start;
+        }
+
+        if (sent_prev != sent_cur || st_prev.stopped || st_cur.stopped) {
+            fprintf(stderr, "the two implementations send different text\n");
+            return 1;
+        }
+    }
+
+    printf("%13s | %12s | %12s\n", "tokens", "prev ns/tok", "cur ns/tok");
+
+    for (int b = 0; b < n_buckets; ++b) {
+        printf("%6d-%6d | %12.1f | %12.1f\n", b*n_bucket, (b + 1)*n_bucket, t_prev[b] / n_rep / n_bucket, t_cur[b] / n_rep / n_bucket);
+    }
+
+    return 0;
+}
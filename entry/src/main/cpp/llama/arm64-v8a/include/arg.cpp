@@ -586,14 +586,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
         [](common_params & params, const std::string & value) {
             params.lookup_cache_dynamic = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-c", "--ctx-size"}, "N",
         string_format("size of the prompt context (default: %d, 0 = loaded from model)", params.n_ctx),
@@ -1859,6 +1859,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens added to a batch while other slots are generating, shared by the slots processing a prompt (default: %d, 0 = n_batch)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -1898,6 +1905,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--slot-cache-path"}, "PATH",
+        "path to spill the kv cache of slots evicted by LRU to, it is restored when a later prompt starts with the same tokens (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.slot_cache_path = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_CACHE_PATH"));
+    add_opt(common_arg(
+        {"--slot-cache-size"}, "N",
+        string_format("max size of the on-disk slot cache in MiB (default: %d)", params.slot_cache_size),
+        [](common_params & params, int value) {
+            params.slot_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_CACHE_SIZE"));
     add_opt(common_arg(
         {"--chat-template"}, "JINJA_TEMPLATE",
         string_format(
@@ -2158,6 +2179,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.n_min = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_MIN"));
+    add_opt(common_arg(
+        {"--draft-tree"}, "N",
+        string_format("max number of alternative candidates of the draft model verified next to the greedy draft, as a token tree (default: %d, 0 = disabled)", params.speculative.n_tree),
+        [](common_params & params, int value) {
+            params.speculative.n_tree = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_TREE"));
+    add_opt(common_arg(
+        {"--draft-ngram"},
+        "draft tokens from the n-grams of the prompt and of the generated text instead of a draft model (prompt lookup decoding)",
+        [](common_params & params) {
+            params.speculative.ngram = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_NGRAM"));
     add_opt(common_arg(
         {"--draft-p-split"}, "P",
         string_format("speculative decoding split probability (default: %.1f)", (double)params.speculative.p_split),
@@ -166,6 +166,10 @@ struct common_params_speculative {
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        =  0.9f; // minimum speculative decoding probability (greedy)
 
+    int32_t n_tree       =     0; // max number of alternative draft candidates verified next to the greedy draft (0 = disabled)
+
+    bool ngram = false; // draft from an n-gram cache of the prompt and generated tokens instead of a draft model
+
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
 
@@ -318,6 +322,7 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_prefill_budget = 0;          // max prompt tokens per batch while other slots are generating (0 = n_batch)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -339,6 +344,9 @@ struct common_params {
 
     std::string slot_save_path;
 
+    std::string slot_cache_path;         // directory of the on-disk tier of the slot KV cache
+    int32_t     slot_cache_size = 1024;  // max size of the on-disk slot cache (MiB)
+
     float slot_prompt_similarity = 0.5f;
 
     // batched-bench params
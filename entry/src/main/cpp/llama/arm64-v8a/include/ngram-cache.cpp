@@ -2,12 +2,168 @@
 #include "common.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <thread>
 
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define COMMON_NGRAM_CACHE_MMAP
+#endif
+
+// a file mapped read-only, unmapped when the last cache that uses it is modified or destroyed
+struct common_ngram_cache_mapping {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    ~common_ngram_cache_mapping() {
+#ifdef COMMON_NGRAM_CACHE_MMAP
+        if (addr != nullptr) {
+            munmap(addr, size);
+        }
+#endif
+    }
+};
+
+static common_ngram_entry common_ngram_entry_empty() {
+    common_ngram_entry entry;
+    entry.n_total  = 0;
+    entry.reserved = 0;
+    for (int i = 0; i < LLAMA_NGRAM_TOP_K; ++i) {
+        entry.tokens[i] = LLAMA_TOKEN_NULL;
+        entry.counts[i] = 0;
+    }
+    return entry;
+}
+
+// count token count times, when all followers are tracked the least frequent one is replaced and the new token
+// inherits its count, so that a token that becomes frequent later can still be tracked (space-saving)
+static void common_ngram_entry_add(common_ngram_entry & entry, const llama_token token, const int32_t count) {
+    entry.n_total += count;
+
+    int i = 0;
+    while (i < LLAMA_NGRAM_TOP_K && entry.counts[i] > 0 && entry.tokens[i] != token) {
+        ++i;
+    }
+
+    if (i == LLAMA_NGRAM_TOP_K) {
+        i = LLAMA_NGRAM_TOP_K - 1;
+        entry.tokens[i] = token;
+    } else if (entry.counts[i] == 0) {
+        entry.tokens[i] = token;
+    }
+    entry.counts[i] += count;
+
+    // keep the followers sorted by count
+    for (; i > 0 && entry.counts[i] > entry.counts[i - 1]; --i) {
+        std::swap(entry.tokens[i], entry.tokens[i - 1]);
+        std::swap(entry.counts[i], entry.counts[i - 1]);
+    }
+}
+
+const common_ngram_entry * common_ngram_cache::data() const {
+    if (mapping) {
+        return reinterpret_cast<const common_ngram_entry *>(static_cast<const char *>(mapping->addr) + sizeof(common_ngram_entry));
+    }
+    return entries.data();
+}
+
+void common_ngram_cache::clear() {
+    mapping.reset();
+    if (entries.size() != n_cap) {
+        entries.assign(n_cap, common_ngram_entry_empty());
+    } else {
+        std::fill(entries.begin(), entries.end(), common_ngram_entry_empty());
+    }
+    n_used = 0;
+}
+
+const common_ngram_entry * common_ngram_cache::find(const common_ngram & ngram) const {
+    if (n_used == 0) {
+        return nullptr;
+    }
+
+    const common_ngram_entry * table = data();
+
+    for (size_t i = common_ngram_hash_function{}(ngram) & (n_cap - 1);; i = (i + 1) & (n_cap - 1)) {
+        const common_ngram_entry & entry = table[i];
+        if (entry.empty()) {
+            return nullptr;
+        }
+        if (entry.ngram == ngram) {
+            return &entry;
+        }
+    }
+}
+
+void common_ngram_cache::add(const common_ngram & ngram, const llama_token token, const int32_t count) {
+    common_ngram_entry_add(insert(ngram), token, count);
+}
+
+void common_ngram_cache::merge(const common_ngram_entry & other) {
+    common_ngram_entry & entry = insert(other.ngram);
+
+    int32_t n_tracked = 0;
+    for (int i = 0; i < LLAMA_NGRAM_TOP_K && other.counts[i] > 0; ++i) {
+        common_ngram_entry_add(entry, other.tokens[i], other.counts[i]);
+        n_tracked += other.counts[i];
+    }
+
+    // the followers that the other cache no longer tracks
+    entry.n_total += other.n_total - n_tracked;
+}
+
+common_ngram_entry & common_ngram_cache::insert(const common_ngram & ngram) {
+    // the table is at most 3/4 full
+    if (4*(n_used + 1) > 3*n_cap) {
+        grow();
+    } else if (mapping) {
+        entries.assign(data(), data() + n_cap);
+        mapping.reset();
+    }
+
+    for (size_t i = common_ngram_hash_function{}(ngram) & (n_cap - 1);; i = (i + 1) & (n_cap - 1)) {
+        common_ngram_entry & entry = entries[i];
+        if (entry.empty()) {
+            entry.ngram = ngram;
+            ++n_used;
+            return entry;
+        }
+        if (entry.ngram == ngram) {
+            return entry;
+        }
+    }
+}
+
+void common_ngram_cache::grow() {
+    const size_t n_cap_new = std::max<size_t>(64, 2*n_cap);
+
+    std::vector<common_ngram_entry> entries_new(n_cap_new, common_ngram_entry_empty());
+
+    const common_ngram_entry * table = data();
+    for (size_t j = 0; j < n_cap; ++j) {
+        if (table[j].empty()) {
+            continue;
+        }
+        size_t i = common_ngram_hash_function{}(table[j].ngram) & (n_cap_new - 1);
+        while (!entries_new[i].empty()) {
+            i = (i + 1) & (n_cap_new - 1);
+        }
+        entries_new[i] = table[j];
+    }
+
+    entries = std::move(entries_new);
+    mapping.reset();
+    n_cap = n_cap_new;
+}
+
 void common_ngram_cache_update(common_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
                               std::vector<llama_token> & inp, int nnew, bool print_progress) {
     const int64_t t_start_ms = ggml_time_ms();
@@ -23,19 +179,7 @@ void common_ngram_cache_update(common_ngram_cache & ngram_cache, int ngram_min,
             common_ngram ngram(&inp[ngram_start], ngram_size);
             const llama_token token = inp[i];
 
-            common_ngram_cache::iterator part_it = ngram_cache.find(ngram);
-            if (part_it == ngram_cache.end()) {
-                common_ngram_cache_part part;
-                part.emplace(token, 1);
-                ngram_cache.emplace(ngram, part);
-            } else {
-                common_ngram_cache_part::iterator token_count_it = part_it->second.find(token);
-                if (token_count_it == part_it->second.end()) {
-                    part_it->second.emplace(token, 1);
-                } else {
-                    token_count_it->second++;
-                }
-            }
+            ngram_cache.add(ngram, token, 1);
             ++n_done;
 
             if (print_progress && n_done % 10000000 == 0) {
@@ -62,27 +206,16 @@ constexpr int draft_min_sample_size_strict[LLAMA_NGRAM_MAX] = { 4,  3,  2,  2};
 constexpr int     draft_min_percent_strict[LLAMA_NGRAM_MAX] = {75, 66, 66, 66};
 
 // Helper function that tries to draft a token from only the static ngram cache:
-static llama_token try_draft(common_ngram_cache & nc_static, const common_ngram ngram_static) {
-    common_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-    if (part_static_it == nc_static.end()) {
+static llama_token try_draft(const common_ngram_cache & nc_static, const common_ngram ngram_static) {
+    const common_ngram_entry * part_static = nc_static.find(ngram_static);
+    if (part_static == nullptr) {
         return LLAMA_TOKEN_NULL;
     }
-    const common_ngram_cache_part part_static = part_static_it->second;
-
-    int max_count_static  = 0;
-    int sum_count_static  = 0;
-    llama_token max_token = LLAMA_TOKEN_NULL;
 
-    for (std::pair<llama_token, int> token_count_static : part_static) {
-        const llama_token token = token_count_static.first;
-        const int32_t count_static  = token_count_static.second;
-
-        if (count_static > max_count_static) {
-            max_token        = token;
-            max_count_static = count_static;
-        }
-        sum_count_static += count_static;
-    }
+    // the followers are sorted by count
+    const llama_token max_token        = part_static->tokens[0];
+    const int32_t     max_count_static = part_static->counts[0];
+    const int32_t     sum_count_static = part_static->n_total;
 
     if (sum_count_static < draft_min_sample_size_lax[LLAMA_NGRAM_STATIC-1]) {
         return LLAMA_TOKEN_NULL;
@@ -95,7 +228,7 @@ static llama_token try_draft(common_ngram_cache & nc_static, const common_ngram
 
 // Try to draft a token from primary cache (context/dynamic), validate with static cache:
 static llama_token try_draft(
-    common_ngram_cache & nc_primary, const std::vector<common_ngram> & ngrams_primary, common_ngram_cache_part & part_static,
+    const common_ngram_cache & nc_primary, const std::vector<common_ngram> & ngrams_primary, const common_ngram_entry * part_static,
     const int * min_sample_size, const int * min_percent) {
 
     llama_token drafted_token = LLAMA_TOKEN_NULL;
@@ -103,31 +236,29 @@ static llama_token try_draft(
     for (int i = ngrams_primary.size()-1; i >= 0 && drafted_token == LLAMA_TOKEN_NULL; --i) {
         const common_ngram ngram_primary = ngrams_primary[i];
 
-        common_ngram_cache::iterator part_primary_it = nc_primary.find(ngram_primary);
-        if (part_primary_it == nc_primary.end()) {
+        const common_ngram_entry * part_primary = nc_primary.find(ngram_primary);
+        if (part_primary == nullptr) {
             continue;
         }
-        const common_ngram_cache_part part_primary = part_primary_it->second;
 
         int max_count_primary = 0;
         int max_count_static  = 0;
-        int sum_count_primary = 0;
+        int sum_count_primary = part_primary->n_total;
         llama_token max_token = LLAMA_TOKEN_NULL;
 
-        for (std::pair<llama_token, int> token_count_primary : part_primary) {
-            const llama_token token = token_count_primary.first;
+        for (int j = 0; j < LLAMA_NGRAM_TOP_K && part_primary->counts[j] > 0; ++j) {
+            const llama_token token = part_primary->tokens[j];
 
-            common_ngram_cache_part::iterator token_count_static_it = part_static.find(token);
+            const int32_t count_static_token = part_static != nullptr ? part_static->count(token) : 0;
 
-            const int32_t count_primary = token_count_primary.second;
-            const int32_t count_static  = token_count_static_it != part_static.end() ? 100*token_count_static_it->second : 1;
+            const int32_t count_primary = part_primary->counts[j];
+            const int32_t count_static  = count_static_token > 0 ? 100*count_static_token : 1;
 
             if (count_primary*count_static > max_count_primary*max_count_static) {
                 max_token         = token;
                 max_count_primary = count_primary;
                 max_count_static  = count_static;
             }
-            sum_count_primary += count_primary;
         }
 
         if (sum_count_primary < min_sample_size[i]) {
@@ -161,11 +292,7 @@ void common_ngram_cache_draft(
         for (int j = ngram_start_static; j < ngram_start_static + LLAMA_NGRAM_STATIC; ++j) {
             ngram_static.tokens[j-ngram_start_static] = get_token(inp, draft, j);
         }
-        common_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-        common_ngram_cache_part part_static;
-        if (part_static_it != nc_static.end()) {
-            part_static = part_static_it->second;
-        }
+        const common_ngram_entry * part_static = nc_static.find(ngram_static);
 
         // cd = context + dynamic
         std::vector<common_ngram> ngrams_cd;
@@ -196,34 +323,39 @@ void common_ngram_cache_draft(
     }
 }
 
-void common_ngram_cache_save(common_ngram_cache & ngram_cache, std::string & filename) {
-    std::ofstream file_out(filename, std::ios::binary);
-    for (std::pair<common_ngram, common_ngram_cache_part> item : ngram_cache) {
-        const common_ngram      ngram        = item.first;
-        common_ngram_cache_part token_counts = item.second;
-        GGML_ASSERT(!token_counts.empty());
-        const int32_t ntokens = token_counts.size();
-        GGML_ASSERT(ntokens > 0);
+// the file starts with a header of the size of one entry, followed by the table as it is in memory
+struct common_ngram_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t top_k;
+    uint64_t n_cap;
+    uint64_t n_used;
 
-        file_out.write(reinterpret_cast<const char *>(&ngram),   sizeof(common_ngram));
-        file_out.write(reinterpret_cast<const char *>(&ntokens), sizeof(int32_t));
-        for (std::pair<llama_token, int32_t> item2 : token_counts) {
-            const llama_token token = item2.first;
-            const int32_t     count = item2.second;
-            GGML_ASSERT(count > 0);
+    uint8_t reserved[32];
+};
 
-            file_out.write(reinterpret_cast<const char *>(&token), sizeof(llama_token));
-            file_out.write(reinterpret_cast<const char *>(&count), sizeof(int32_t));
-        }
-    }
+static_assert(sizeof(common_ngram_cache_header) == sizeof(common_ngram_entry), "the table must stay aligned to cache lines");
+
+static constexpr uint32_t common_ngram_cache_magic   = 0x4352474e; // "NGRC"
+static constexpr uint32_t common_ngram_cache_version = 1;
+
+void common_ngram_cache_save(common_ngram_cache & ngram_cache, std::string & filename) {
+    common_ngram_cache_header header = {};
+    header.magic      = common_ngram_cache_magic;
+    header.version    = common_ngram_cache_version;
+    header.entry_size = sizeof(common_ngram_entry);
+    header.top_k      = LLAMA_NGRAM_TOP_K;
+    header.n_cap      = ngram_cache.capacity();
+    header.n_used     = ngram_cache.size();
 
+    std::ofstream file_out(filename, std::ios::binary);
+    file_out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file_out.write(reinterpret_cast<const char *>(ngram_cache.data()), ngram_cache.capacity()*sizeof(common_ngram_entry));
 }
 
-common_ngram_cache common_ngram_cache_load(std::string & filename) {
-    std::ifstream hashmap_file(filename, std::ios::binary);
-    if (!hashmap_file) {
-        throw std::ifstream::failure("Unable to open file " + filename);
-    }
+// caches written before the table format: for each n-gram, the number of following tokens and their counts
+static common_ngram_cache common_ngram_cache_load_legacy(std::ifstream & hashmap_file) {
     common_ngram_cache ngram_cache;
 
     common_ngram ngram;
@@ -239,7 +371,6 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
         GGML_ASSERT(!hashmap_file.eof());
         GGML_ASSERT(hashmap_file.read(ntokensc, sizeof(int32_t)));
         GGML_ASSERT(ntokens > 0);
-        common_ngram_cache_part token_counts;
 
         for (int i = 0; i < ntokens; ++i) {
             GGML_ASSERT(!hashmap_file.eof());
@@ -247,39 +378,76 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
             GGML_ASSERT(!hashmap_file.eof());
             GGML_ASSERT(hashmap_file.read(countc, sizeof(int32_t)));
             GGML_ASSERT(count > 0);
-            token_counts.emplace(token, count);
+            ngram_cache.add(ngram, token, count);
         }
-
-        ngram_cache.emplace(ngram, token_counts);
     }
     GGML_ASSERT(hashmap_file.eof());
 
     return ngram_cache;
 }
 
-void common_ngram_cache_merge(common_ngram_cache & ngram_cache_target, common_ngram_cache & ngram_cache_add) {
-    for (std::pair<common_ngram, common_ngram_cache_part> ngram_part : ngram_cache_add) {
-        const common_ngram      ngram = ngram_part.first;
-        common_ngram_cache_part  part = ngram_part.second;
+common_ngram_cache common_ngram_cache_load(std::string & filename) {
+    std::ifstream hashmap_file(filename, std::ios::binary);
+    if (!hashmap_file) {
+        throw std::ifstream::failure("Unable to open file " + filename);
+    }
 
-        common_ngram_cache::iterator part_merged_it = ngram_cache_target.find(ngram);
-        if (part_merged_it == ngram_cache_target.end()) {
-            ngram_cache_target.emplace(ngram, part);
-            continue;
+    common_ngram_cache_header header = {};
+    hashmap_file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!hashmap_file || header.magic != common_ngram_cache_magic) {
+        hashmap_file.clear();
+        hashmap_file.seekg(0);
+        return common_ngram_cache_load_legacy(hashmap_file);
+    }
+
+    GGML_ASSERT(header.version    == common_ngram_cache_version);
+    GGML_ASSERT(header.entry_size == sizeof(common_ngram_entry));
+    GGML_ASSERT(header.top_k      == LLAMA_NGRAM_TOP_K);
+    GGML_ASSERT((header.n_cap & (header.n_cap - 1)) == 0);
+    GGML_ASSERT(4*header.n_used <= 3*header.n_cap);
+
+    const size_t n_bytes = sizeof(header) + header.n_cap*sizeof(common_ngram_entry);
+
+    common_ngram_cache ngram_cache;
+    ngram_cache.n_cap  = header.n_cap;
+    ngram_cache.n_used = header.n_used;
+
+    if (header.n_cap == 0) {
+        return ngram_cache;
+    }
+
+#ifdef COMMON_NGRAM_CACHE_MMAP
+    const int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size >= n_bytes) {
+        void * addr = mmap(nullptr, n_bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            close(fd);
+
+            ngram_cache.mapping = std::make_shared<common_ngram_cache_mapping>();
+            ngram_cache.mapping->addr = addr;
+            ngram_cache.mapping->size = n_bytes;
+
+            return ngram_cache;
         }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
 
-        for (std::pair<llama_token, int32_t> token_count : part) {
-            const llama_token token = token_count.first;
-            const int32_t     count = token_count.second;
-            GGML_ASSERT(count > 0);
+    ngram_cache.entries.resize(header.n_cap);
+    GGML_ASSERT(hashmap_file.read(reinterpret_cast<char *>(ngram_cache.entries.data()), header.n_cap*sizeof(common_ngram_entry)));
 
-            common_ngram_cache_part::iterator token_count_merged_it = part_merged_it->second.find(token);
-            if (token_count_merged_it == part_merged_it->second.end()) {
-                part_merged_it->second.emplace(token, count);
-                continue;
-            }
+    return ngram_cache;
+}
 
-            token_count_merged_it->second += count;
+void common_ngram_cache_merge(common_ngram_cache & ngram_cache_target, common_ngram_cache & ngram_cache_add) {
+    const common_ngram_entry * table = ngram_cache_add.data();
+    for (size_t i = 0; i < ngram_cache_add.capacity(); ++i) {
+        if (table[i].empty()) {
+            continue;
         }
+        ngram_cache_target.merge(table[i]);
     }
 }
@@ -2,7 +2,8 @@
 
 #include "llama.h"
 
-#include <unordered_map>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -44,22 +45,92 @@ struct common_token_hash_function {
     }
 };
 
+// order-sensitive, so that permutations of the same tokens do not collide
 struct common_ngram_hash_function {
-    size_t operator()(const common_ngram & ngram) const {
-        size_t hash = common_token_hash_function{}(ngram.tokens[0]);
-        for (int i = 1; i < LLAMA_NGRAM_MAX; ++i) {
-            hash ^= common_token_hash_function{}(ngram.tokens[i]);
+    uint64_t operator()(const common_ngram & ngram) const {
+        uint64_t hash = 0;
+        for (int i = 0; i < LLAMA_NGRAM_MAX; ++i) {
+            hash = (hash ^ (uint32_t) ngram.tokens[i]) * 11400714819323198485llu;
+            hash ^= hash >> 32;
         }
         return hash;
     }
 };
 
-// token -> number of times token has been seen
-typedef std::unordered_map<llama_token, int32_t> common_ngram_cache_part;
+// number of following tokens tracked per n-gram
+#define LLAMA_NGRAM_TOP_K 5
+
+// n-gram -> empirical distribution of the most frequent following tokens, one cache line per n-gram
+struct common_ngram_entry {
+    common_ngram ngram;   // LLAMA_TOKEN_NULL as first token marks an unused entry
+    int32_t      n_total; // number of times the n-gram has been seen, including the followers that are not tracked
+
+    llama_token tokens[LLAMA_NGRAM_TOP_K];
+    int32_t     counts[LLAMA_NGRAM_TOP_K]; // sorted in descending order, 0 for unused followers
+
+    int32_t reserved;
+
+    bool empty() const {
+        return ngram.tokens[0] == LLAMA_TOKEN_NULL;
+    }
+
+    // number of times token has been seen after the n-gram, 0 if it is not tracked
+    int32_t count(llama_token token) const {
+        for (int i = 0; i < LLAMA_NGRAM_TOP_K && counts[i] > 0; ++i) {
+            if (tokens[i] == token) {
+                return counts[i];
+            }
+        }
+        return 0;
+    }
+};
+
+static_assert(sizeof(common_ngram_entry) == 64, "common_ngram_entry must fill exactly one cache line");
+
+struct common_ngram_cache_mapping;
 
-// n-gram -> empirical distribution of following tokens
-typedef std::unordered_map<common_ngram, common_ngram_cache_part, common_ngram_hash_function> common_ngram_cache;
+// open-addressed hash table of n-grams with linear probing
+// a cache loaded from a file maps the file read-only and is copied to memory on the first modification
+struct common_ngram_cache {
+    size_t size() const {
+        return n_used;
+    }
 
+    bool empty() const {
+        return n_used == 0;
+    }
+
+    // number of entries of the table, including the unused ones
+    size_t capacity() const {
+        return n_cap;
+    }
+
+    // the entries of the table, including the unused ones
+    const common_ngram_entry * data() const;
+
+    void clear();
+
+    // returns nullptr if the n-gram is not in the cache
+    const common_ngram_entry * find(const common_ngram & ngram) const;
+
+    // count token count times after ngram
+    void add(const common_ngram & ngram, llama_token token, int32_t count);
+
+    // add all the followers of an entry of another cache
+    void merge(const common_ngram_entry & other);
+
+private:
+    std::vector<common_ngram_entry> entries;
+    std::shared_ptr<common_ngram_cache_mapping> mapping;
+
+    size_t n_cap  = 0; // power of 2
+    size_t n_used = 0;
+
+    common_ngram_entry & insert(const common_ngram & ngram);
+    void grow();
+
+    friend common_ngram_cache common_ngram_cache_load(std::string & filename);
+};
 
 // Update an ngram cache with tokens.
 // ngram_cache:         the cache to modify.
@@ -87,10 +158,13 @@ void common_ngram_cache_draft(
 
 // Save an ngram cache to a file.
 // ngram_cache: the ngram cache to save.
-// filename:    the path under which to save the ngram cache.
+// filename:    the path under which to save the ngram cache. It must not be the file the cache was loaded from,
+//              since the file is still mapped, write to another file and rename it instead.
 void common_ngram_cache_save(common_ngram_cache & ngram_cache, std::string & filename);
 
 // Load an ngram cache saved with common_ngram_cache_save.
+// The table is mapped directly from the file where possible, caches in the previous format (a list of n-grams with
+// the counts of all their following tokens) are converted on load.
 // filename: the path from which to load the ngram cache.
 // returns:  an ngram cache containing the information saved to filename.
 common_ngram_cache common_ngram_cache_load(std::string & filename);
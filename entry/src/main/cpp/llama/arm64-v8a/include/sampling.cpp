@@ -2,9 +2,14 @@
 
 #include "common.h"
 
+#include <algorithm>
 #include <cmath>
 #include <unordered_map>
 
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 // TODO: deduplicate with llama-impl.h
 template<typename T>
@@ -106,23 +111,202 @@ struct common_sampler {
 
     ring_buffer<llama_token> prev;
 
+    // the candidates, the buffer is reused by all the calls
     std::vector<llama_token_data> cur;
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // candidates that can be dropped before the sampling chain runs without changing its result, see init_prefilter()
+    int32_t prefilter_top_k    = 0;    // keep the top_k most likely tokens       (0 = disabled)
+    float   prefilter_min_p    = 0.0f; // keep the tokens with p >= min_p * p_max (0 = disabled)
+    int32_t prefilter_min_keep = 1;    // fall back to all the tokens if fewer are kept
+
+    // find the truncating samplers at the start of the chain
+    // the samplers before them must not be able to raise a logit, and the ones that lower some logits widen the top_k
+    void init_prefilter() {
+        prefilter_top_k    = 0;
+        prefilter_min_p    = 0.0f;
+        prefilter_min_keep = std::max(1, params.min_keep);
+
+        if (params.mirostat != 0) {
+            return;
+        }
+
+        int32_t n_lowered = 0; // max number of tokens that may have been lowered by the previous samplers
+
+        for (const auto & bias : params.logit_bias) {
+            if (bias.bias > 0.0f) {
+                return;
+            }
+            n_lowered++;
+        }
+
+        for (const auto & cnstr : params.samplers) {
+            switch (cnstr) {
+                case COMMON_SAMPLER_TYPE_PENALTIES:
+                    {
+                        if (params.penalty_last_n == 0 || (params.penalty_repeat == 1.0f && params.penalty_freq == 0.0f && params.penalty_present == 0.0f)) {
+                            continue;
+                        }
+                        if (params.penalty_last_n < 0 || params.penalty_repeat < 1.0f || params.penalty_freq < 0.0f || params.penalty_present < 0.0f) {
+                            return;
+                        }
+                        n_lowered += params.penalty_last_n;
+                    } break;
+                case COMMON_SAMPLER_TYPE_DRY:
+                    {
+                        if (params.dry_multiplier == 0.0f || params.dry_base < 1.0f || params.dry_penalty_last_n == 0) {
+                            continue;
+                        }
+                        return;
+                    }
+                case COMMON_SAMPLER_TYPE_TOP_K:
+                    {
+                        if (params.top_k <= 0) {
+                            continue;
+                        }
+                        const int32_t top_k = params.top_k + n_lowered;
+                        prefilter_top_k = prefilter_top_k > 0 ? std::min(prefilter_top_k, top_k) : top_k;
+                    } break;
+                case COMMON_SAMPLER_TYPE_MIN_P:
+                    {
+                        if (params.min_p <= 0.0f) {
+                            continue;
+                        }
+                        // the threshold is relative to the max logit, which must not have been lowered
+                        if (n_lowered > 0) {
+                            return;
+                        }
+                        prefilter_min_p = params.min_p;
+                    } break;
+                case COMMON_SAMPLER_TYPE_TOP_P:
+                    {
+                        if (params.top_p >= 1.0f) {
+                            continue;
+                        }
+                        return;
+                    }
+                case COMMON_SAMPLER_TYPE_TYPICAL_P:
+                    {
+                        if (params.typ_p >= 1.0f) {
+                            continue;
+                        }
+                        return;
+                    }
+                case COMMON_SAMPLER_TYPE_XTC:
+                    {
+                        if (params.xtc_probability <= 0.0f || params.xtc_threshold > 0.5f) {
+                            continue;
+                        }
+                        return;
+                    }
+                default:
+                    return;
+            }
+        }
+    }
 
-        const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    // prefilter: only keep the candidates that the truncating samplers at the start of the chain would keep
+    void set_logits(const float * logits, int n_vocab, bool prefilter = false) {
+        if (prefilter && (prefilter_top_k > 0 || prefilter_min_p > 0.0f) && prefilter_top_k < n_vocab && set_logits_prefiltered(logits, n_vocab)) {
+            return;
+        }
 
         cur.resize(n_vocab);
 
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        llama_token token_id = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        // llama_token_data is {id, logit, p} - write 4 of them at a time with an interleaving store
+        static_assert(sizeof(llama_token_data) == 3*sizeof(float), "unexpected llama_token_data layout");
+
+        int32_t ids[4] = { 0, 1, 2, 3 };
+
+        int32x4_t       vid   = vld1q_s32(ids);
+        const int32x4_t vstep = vdupq_n_s32(4);
+        const float32x4_t vzero = vdupq_n_f32(0.0f);
+
+        for (; token_id + 4 <= n_vocab; token_id += 4) {
+            float32x4x3_t v;
+            v.val[0] = vreinterpretq_f32_s32(vid);
+            v.val[1] = vld1q_f32(logits + token_id);
+            v.val[2] = vzero;
+
+            vst3q_f32(reinterpret_cast<float *>(cur.data() + token_id), v);
+
+            vid = vaddq_s32(vid, vstep);
+        }
+#endif
+
+        for (; token_id < n_vocab; token_id++) {
             cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
         }
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // returns false if too few candidates would be kept, the caller must then use the full vocabulary
+    bool set_logits_prefiltered(const float * logits, int n_vocab) {
+        float min_logit = -INFINITY;
+
+        if (prefilter_min_p > 0.0f) {
+            float max_logit = -INFINITY;
+
+            int i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+            float32x4_t vmax = vdupq_n_f32(-INFINITY);
+            for (; i + 4 <= n_vocab; i += 4) {
+                vmax = vmaxq_f32(vmax, vld1q_f32(logits + i));
+            }
+            max_logit = vmaxvq_f32(vmax);
+#endif
+            for (; i < n_vocab; ++i) {
+                max_logit = std::max(max_logit, logits[i]);
+            }
+
+            // same as in the min-p sampler
+            min_logit = max_logit + logf(prefilter_min_p);
+        }
+
+        cur.clear();
+
+        if (prefilter_top_k > 0) {
+            // min-heap, the front is the least likely of the kept tokens
+            const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
+                return a.logit > b.logit;
+            };
+
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                const float logit = logits[token_id];
+                if (logit < min_logit) {
+                    continue;
+                }
+
+                if ((int32_t) cur.size() < prefilter_top_k) {
+                    cur.push_back({token_id, logit, 0.0f});
+                    std::push_heap(cur.begin(), cur.end(), cmp);
+                } else if (logit > cur.front().logit) {
+                    std::pop_heap(cur.begin(), cur.end(), cmp);
+                    cur.back() = {token_id, logit, 0.0f};
+                    std::push_heap(cur.begin(), cur.end(), cmp);
+                }
+            }
+        } else {
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                if (logits[token_id] >= min_logit) {
+                    cur.push_back({token_id, logits[token_id], 0.0f});
+                }
+            }
+        }
+
+        if ((int32_t) cur.size() < prefilter_min_keep) {
+            return false;
+        }
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+
+        return true;
+    }
 };
 
 std::string common_params_sampling::print() const {
@@ -155,6 +339,8 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         /* .cur_p  = */ {},
     };
 
+    result->init_prefilter();
+
     llama_sampler_chain_add(result->chain,
             llama_sampler_init_logit_bias(
                 llama_n_vocab(model),
@@ -251,6 +437,9 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+        /* .prefilter_top_k    = */ gsmpl->prefilter_top_k,
+        /* .prefilter_min_p    = */ gsmpl->prefilter_min_p,
+        /* .prefilter_min_keep = */ gsmpl->prefilter_min_keep,
     };
 }
 
@@ -266,7 +455,12 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+    return common_sampler_sample_logits(gsmpl, llama_get_logits_ith(ctx, idx), llama_n_vocab(llama_get_model(ctx)), grammar_first);
+}
+
+llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first) {
+    // the grammar may reject all the tokens kept by the prefilter, so it needs the full vocabulary
+    gsmpl->set_logits(logits, n_vocab, !grammar_first);
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -301,7 +495,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(logits, n_vocab);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -350,6 +544,42 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
     return common_sampler_sample_and_accept_n(gsmpl, ctx, idxs, draft, grammar_first);
 }
 
+std::vector<llama_token> common_sampler_sample_and_accept_tree(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, const std::vector<int> & parents, std::vector<int> & path, bool grammar_first) {
+    GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
+    GGML_ASSERT(parents.size() == draft.size() && "parents.size() must be draft.size()");
+
+    std::vector<llama_token> result;
+
+    path.clear();
+
+    // -1 is the last sampled token
+    int cur = -1;
+    while (true) {
+        const llama_token id = common_sampler_sample(gsmpl, ctx, idxs[cur + 1], grammar_first);
+
+        common_sampler_accept(gsmpl, id, true);
+
+        result.push_back(id);
+
+        int next = -1;
+        for (size_t i = 0; i < draft.size(); i++) {
+            if (parents[i] == cur && draft[i] == id) {
+                next = i;
+                break;
+            }
+        }
+
+        if (next < 0) {
+            break;
+        }
+
+        path.push_back(next);
+        cur = next;
+    }
+
+    return result;
+}
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
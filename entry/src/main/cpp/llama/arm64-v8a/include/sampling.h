@@ -60,6 +60,10 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// same as common_sampler_sample, with the logits of the output already retrieved with llama_get_logits_ith()
+// the context is not accessed, so the samplers of different sequences can run in parallel
+llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
@@ -81,6 +85,20 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
 // assume idxs == [ 0, 1, 2, ..., draft.size() ]
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const llama_tokens & draft, bool grammar_first = false);
 
+// tree version of common_sampler_sample_and_accept_n
+//
+// the draft is a tree of tokens, parents[i] is the index in draft of the parent of draft[i], -1 for the children of
+// the last sampled token, whose output is at idxs[0] - the output of draft[i] is at idxs[i + 1]
+// after each sampled token, the walk continues with the child that matches it
+//
+// the indices in draft of the accepted tokens are returned in path
+//
+// requires: idxs.size() == draft.size() + 1, parents.size() == draft.size()
+//
+// returns path.size() + 1 tokens
+//
+std::vector<llama_token> common_sampler_sample_and_accept_tree(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, const std::vector<int> & parents, std::vector<int> & path, bool grammar_first = false);
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
 // helpers
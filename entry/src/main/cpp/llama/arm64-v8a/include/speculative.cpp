@@ -4,7 +4,9 @@
 #include "common.h"
 #include "sampling.h"
 
+#include <algorithm>
 #include <cstring>
+#include <memory>
 
 #define SPEC_VOCAB_MAX_SIZE_DIFFERENCE  128
 #define SPEC_VOCAB_CHECK_START_TOKEN_ID 5
@@ -13,19 +15,35 @@ struct common_speculative {
     struct llama_context * ctx;
     struct common_sampler * smpl;
 
+    llama_seq_id seq_id;
+    int          n_ctx; // context size of the sequence
+
     llama_batch batch;
-    llama_tokens prompt;
+    llama_tokens prompt; // the tokens of the sequence in the KV cache
+
+    // the speculators sharing ctx, including this one
+    std::shared_ptr<std::vector<common_speculative *>> peers;
 };
 
 struct common_speculative * common_speculative_init(
-        struct llama_context * ctx_dft) {
+        struct llama_context * ctx_dft,
+        llama_seq_id seq_id,
+        struct common_speculative * peer) {
+    GGML_ASSERT(peer == nullptr || peer->ctx == ctx_dft);
+    GGML_ASSERT(seq_id >= 0 && seq_id < (llama_seq_id) llama_n_seq_max(ctx_dft));
+
     auto * result = new common_speculative {
         /* .ctx    = */ ctx_dft,
         /* .smpl   = */ nullptr,
+        /* .seq_id = */ seq_id,
+        /* .n_ctx  = */ (int) (llama_n_ctx(ctx_dft) / llama_n_seq_max(ctx_dft)),
         /* .batch  = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
         /* .prompt = */ {},
+        /* .peers  = */ peer ? peer->peers : std::make_shared<std::vector<common_speculative *>>(),
     };
 
+    result->peers->push_back(result);
+
     // TODO: optimize or pass from outside?
 #if 0
     {
@@ -66,6 +84,11 @@ void common_speculative_free(struct common_speculative * spec) {
         return;
     }
 
+    auto & peers = *spec->peers;
+    peers.erase(std::remove(peers.begin(), peers.end(), spec), peers.end());
+
+    llama_kv_cache_seq_rm(spec->ctx, spec->seq_id, -1, -1);
+
     common_sampler_free(spec->smpl);
 
     llama_batch_free(spec->batch);
@@ -130,20 +153,30 @@ bool common_speculative_are_compatible(
     return true;
 }
 
-llama_tokens common_speculative_gen_draft(
+// a candidate of the draft model that is not on the greedy chain
+struct common_speculative_leaf {
+    llama_token id;
+    int         parent; // index in the chain, -1 for a child of id_last
+    float       p;      // probability of the path from id_last
+};
+
+static llama_tokens common_speculative_gen_draft_impl(
         struct common_speculative * spec,
         struct common_speculative_params params,
         const llama_tokens & prompt_tgt,
-        llama_token id_last) {
+        llama_token id_last,
+        std::vector<common_speculative_leaf> * leaves) {
     auto & batch  = spec->batch;
     auto & ctx    = spec->ctx;
     auto & smpl   = spec->smpl;
     auto & prompt = spec->prompt;
 
+    const llama_seq_id seq_id = spec->seq_id;
+
     int reuse_i = 0;
     int reuse_n = 0;
 
-    const int n_ctx = llama_n_ctx(ctx) - params.n_draft;
+    const int n_ctx = spec->n_ctx - params.n_draft;
 
     const int i_start = std::max<int>(0, (int) prompt_tgt.size() - n_ctx);
 
@@ -169,9 +202,38 @@ llama_tokens common_speculative_gen_draft(
     result.reserve(params.n_draft);
 
     if (reuse_n == 0) {
-        llama_kv_cache_clear(ctx);
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
 
         prompt.clear();
+
+        // start from the longest prefix cached by another speculator, at the same positions
+        const common_speculative * src = nullptr;
+
+        for (const common_speculative * peer : *spec->peers) {
+            if (peer == spec) {
+                continue;
+            }
+
+            int cur = 0;
+            while (i_start + cur < (int) prompt_tgt.size() &&
+                   cur < (int) peer->prompt.size() &&
+                   prompt_tgt[i_start + cur] == peer->prompt[cur]) {
+                cur++;
+            }
+
+            if (cur > reuse_n) {
+                src     = peer;
+                reuse_n = cur;
+            }
+        }
+
+        if (src) {
+            LOG_DBG("%s: sharing %d tokens of seq %d\n", __func__, reuse_n, src->seq_id);
+
+            llama_kv_cache_seq_cp(ctx, src->seq_id, seq_id, 0, reuse_n);
+
+            prompt.assign(src->prompt.begin(), src->prompt.begin() + reuse_n);
+        }
     } else {
         // this happens when a previous draft has been discarded (for example, due to being too small), but the
         // target model agreed with it. in this case, we simply pass back the previous results to save compute
@@ -188,14 +250,14 @@ llama_tokens common_speculative_gen_draft(
         }
 
         if (reuse_i > 0) {
-            llama_kv_cache_seq_rm (ctx, 0, 0, reuse_i);
-            llama_kv_cache_seq_add(ctx, 0, reuse_i, -1, -reuse_i);
+            llama_kv_cache_seq_rm (ctx, seq_id, 0, reuse_i);
+            llama_kv_cache_seq_add(ctx, seq_id, reuse_i, -1, -reuse_i);
 
             prompt.erase(prompt.begin(), prompt.begin() + reuse_i);
         }
 
         if (reuse_n < (int) prompt.size()) {
-            llama_kv_cache_seq_rm (ctx, 0, reuse_n, -1);
+            llama_kv_cache_seq_rm (ctx, seq_id, reuse_n, -1);
 
             prompt.erase(prompt.begin() + reuse_n, prompt.end());
         }
@@ -206,16 +268,32 @@ llama_tokens common_speculative_gen_draft(
 
     for (size_t i = i_start + reuse_n; i < prompt_tgt.size(); ++i) {
         //LOG_DBG("i = %d, i_start = %d, reuse_n = %d, i - i_start = %d, id = %6d\n", i, i_start, reuse_n, i - i_start, prompt_tgt[i]);
-        common_batch_add(batch, prompt_tgt[i], i - i_start, { 0 }, false);
+        common_batch_add(batch, prompt_tgt[i], i - i_start, { seq_id }, false);
 
         prompt.push_back(prompt_tgt[i]);
     }
 
+    // the KV cache is shared with the other speculators, so a decode can fail when it is full
+    // the sequence is dropped then, and the next draft starts over
+    const auto decode = [&]() {
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_WRN("%s: failed to decode the draft batch of seq %d, n_tokens = %d\n", __func__, seq_id, batch.n_tokens);
+
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            prompt.clear();
+
+            return false;
+        }
+        return true;
+    };
+
     // we should rarely end-up here during normal decoding
     if (batch.n_tokens > 0) {
         //LOG_DBG("%s: draft prompt batch: %s\n", __func__, string_from(ctx, batch).c_str());
 
-        llama_decode(ctx, batch);
+        if (!decode()) {
+            return result;
+        }
     }
 
     const llama_pos n_past = prompt.size();
@@ -223,16 +301,21 @@ llama_tokens common_speculative_gen_draft(
     LOG_DBG("%s: n_past = %d\n", __func__, n_past);
 
     common_batch_clear(batch);
-    common_batch_add  (batch, id_last, n_past, { 0 }, true);
+    common_batch_add  (batch, id_last, n_past, { seq_id }, true);
 
     prompt.push_back(id_last);
 
     //LOG_DBG("%s: draft prompt: %s\n", __func__, string_from(ctx, prompt).c_str());
 
-    llama_decode(ctx, batch);
+    if (!decode()) {
+        return result;
+    }
 
     common_sampler_reset(smpl);
 
+    // probability of the chain drafted so far
+    float p_chain = 1.0f;
+
     // sample n_draft tokens from the draft model
     for (int i = 0; i < params.n_draft; ++i) {
         common_batch_clear(batch);
@@ -249,11 +332,25 @@ llama_tokens common_speculative_gen_draft(
         // add drafted token for each sequence
         const llama_token id = cur_p->data[0].id;
 
+        // the other candidates at this position, including the first one if the chain stops here
+        if (leaves) {
+            const bool is_last = cur_p->data[0].p < params.p_min;
+            for (size_t k = is_last ? 0 : 1; k < cur_p->size; ++k) {
+                const float p = p_chain*cur_p->data[k].p;
+                if (p < params.p_tree_min) {
+                    break;
+                }
+                leaves->push_back({ cur_p->data[k].id, i - 1, p });
+            }
+        }
+
         // only collect very high-confidence draft tokens
         if (cur_p->data[0].p < params.p_min) {
             break;
         }
 
+        p_chain *= cur_p->data[0].p;
+
         common_sampler_accept(smpl, id, true);
 
         result.push_back(id);
@@ -262,13 +359,51 @@ llama_tokens common_speculative_gen_draft(
             break;
         }
 
-        common_batch_add(batch, id, n_past + i + 1, { 0 }, true);
+        common_batch_add(batch, id, n_past + i + 1, { seq_id }, true);
 
         // evaluate the drafted tokens on the draft model
-        llama_decode(ctx, batch);
+        if (!decode()) {
+            break;
+        }
 
         prompt.push_back(id);
     }
 
     return result;
 }
+
+llama_tokens common_speculative_gen_draft(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last) {
+    return common_speculative_gen_draft_impl(spec, params, prompt_tgt, id_last, nullptr);
+}
+
+llama_tokens common_speculative_gen_draft_tree(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last,
+        std::vector<int> & parents) {
+    std::vector<common_speculative_leaf> leaves;
+
+    llama_tokens result = common_speculative_gen_draft_impl(spec, params, prompt_tgt, id_last, params.n_tree > 0 ? &leaves : nullptr);
+
+    parents.resize(result.size());
+    for (size_t i = 0; i < result.size(); ++i) {
+        parents[i] = (int) i - 1;
+    }
+
+    // keep the most likely candidates
+    std::stable_sort(leaves.begin(), leaves.end(), [](const common_speculative_leaf & a, const common_speculative_leaf & b) {
+        return a.p > b.p;
+    });
+
+    for (size_t i = 0; i < leaves.size() && (int) i < params.n_tree; ++i) {
+        result.push_back(leaves[i].id);
+        parents.push_back(leaves[i].parent);
+    }
+
+    return result;
+}
@@ -10,9 +10,18 @@ struct common_speculative_params {
     int n_reuse = 256;
 
     float p_min = 0.9f; // min probabiliy required to accept a token in the draft
+
+    int   n_tree     = 0;    // max number of alternative candidates added to the draft as leaves (0 = greedy chain only)
+    float p_tree_min = 0.1f; // min probability of the path to an alternative candidate
 };
 
-struct common_speculative * common_speculative_init(struct llama_context * ctx_dft);
+// the speculators created with the same peer share ctx_dft: each one drafts in its own sequence seq_id of the KV cache
+// and a sequence that cannot reuse its own cache starts from the longest cached prefix of the others
+// the context size of each sequence is llama_n_ctx(ctx_dft) / llama_n_seq_max(ctx_dft)
+struct common_speculative * common_speculative_init(
+        struct llama_context * ctx_dft,
+                llama_seq_id   seq_id = 0,
+   struct common_speculative * peer   = nullptr);
 
 void common_speculative_free(struct common_speculative * spec);
 
@@ -26,3 +35,14 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+// draft a tree of tokens: the greedy chain of up to n_draft tokens, followed by up to n_tree of the other top
+// candidates of the draft model at each position of the chain, which are not extended further
+// parents[i] is the index of the parent of the i-th token in the result, -1 for the children of id_last
+// the chain comes first, so the first tokens with parents[i] == i - 1 are the same as common_speculative_gen_draft()
+llama_tokens common_speculative_gen_draft_tree(
+               struct common_speculative * spec,
+        struct common_speculative_params   params,
+                      const llama_tokens & prompt,
+                             llama_token   id_last,
+                      std::vector<int>   & parents);
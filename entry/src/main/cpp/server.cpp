@@ -5,6 +5,7 @@
 #include "llama/arm64-v8a/include/json-schema-to-grammar.h"
 #include "llama/arm64-v8a/include/llama.h"
 #include "llama/arm64-v8a/include/log.h"
+#include "llama/arm64-v8a/include/ngram-cache.h"
 #include "llama/arm64-v8a/include/sampling.h"
 #include "llama/arm64-v8a/include/speculative.h"
 
@@ -18,11 +19,14 @@
 #include "index.html.gz.hpp"
 #include "loading.html.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <filesystem>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -59,7 +63,6 @@ enum server_task_type {
     SERVER_TASK_TYPE_RERANK,
     SERVER_TASK_TYPE_INFILL,
     SERVER_TASK_TYPE_CANCEL,
-    SERVER_TASK_TYPE_NEXT_RESPONSE,
     SERVER_TASK_TYPE_METRICS,
     SERVER_TASK_TYPE_SLOT_SAVE,
     SERVER_TASK_TYPE_SLOT_RESTORE,
@@ -94,6 +97,7 @@ struct slot_params {
     int32_t n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t n_predict = -1; // new tokens to predict
     int32_t n_indent  =  0; // mininum line indentation for the generated text in number of whitespace characters
+    int32_t priority  =  0; // higher priority tasks are scheduled first and may preempt lower priority ones
 
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
@@ -106,6 +110,11 @@ struct slot_params {
     bool post_sampling_probs = false;
     bool ignore_eos = false;
 
+    // in stream mode, coalesce consecutive tokens into one event until one of the limits is reached (0 = no limit)
+    // the tokens are sent one by one when both are 0
+    int32_t stream_flush_ms   = 0; // max time the first token of an event is held back
+    int32_t stream_min_tokens = 0; // number of tokens after which an event is sent
+
     struct common_params_sampling sampling;
     struct common_params_speculative speculative;
 
@@ -155,8 +164,11 @@ struct slot_params {
             {"max_tokens",                n_predict}, // User configured n_predict
             {"n_keep",                    n_keep},
             {"n_discard",                 n_discard},
+            {"priority",                  priority},
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
+            {"stream_flush_ms",           stream_flush_ms},
+            {"stream_min_tokens",         stream_min_tokens},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
             {"n_probs",                   sampling.n_probs},
             {"min_keep",                  sampling.min_keep},
@@ -165,6 +177,8 @@ struct slot_params {
             {"speculative.n_max",         speculative.n_max},
             {"speculative.n_min",         speculative.n_min},
             {"speculative.p_min",         speculative.p_min},
+            {"speculative.ngram",         speculative.ngram},
+            {"speculative.n_tree",        speculative.n_tree},
             {"timings_per_token",         timings_per_token},
             {"post_sampling_probs",       post_sampling_probs},
             {"lora",                      lora},
@@ -200,7 +214,10 @@ struct server_task {
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_lora_adapter_info> set_lora;
 
-    server_task(server_task_type type) : type(type) {}
+    // time the task was created, used to measure the queueing delay
+    int64_t t_queued;
+
+    server_task(server_task_type type) : type(type), t_queued(ggml_time_us()) {}
 
     static slot_params params_from_json_cmpl(
             const llama_model * model,
@@ -219,12 +236,15 @@ struct server_task {
         params.timings_per_token = json_value(data, "timings_per_token", false);
 
         params.stream           = json_value(data, "stream",             false);
+        params.stream_flush_ms   = std::max(0, json_value(data, "stream_flush_ms",   defaults.stream_flush_ms));
+        params.stream_min_tokens = std::max(0, json_value(data, "stream_min_tokens", defaults.stream_min_tokens));
         params.cache_prompt     = json_value(data, "cache_prompt",       true);
         params.return_tokens    = json_value(data, "return_tokens",      false);
         params.n_predict        = json_value(data, "n_predict",          json_value(data, "max_tokens", defaults.n_predict));
         params.n_indent         = json_value(data, "n_indent",           defaults.n_indent);
         params.n_keep           = json_value(data, "n_keep",             defaults.n_keep);
         params.n_discard        = json_value(data, "n_discard",          defaults.n_discard);
+        params.priority         = json_value(data, "priority",           defaults.priority);
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
@@ -257,6 +277,10 @@ struct server_task {
         params.speculative.n_min = json_value(data, "speculative.n_min", defaults.speculative.n_min);
         params.speculative.n_max = json_value(data, "speculative.n_max", defaults.speculative.n_max);
         params.speculative.p_min = json_value(data, "speculative.p_min", defaults.speculative.p_min);
+        params.speculative.ngram = json_value(data, "speculative.ngram", defaults.speculative.ngram);
+
+        // the batch of the server has room for the sequences of --draft-tree candidates at most
+        params.speculative.n_tree = std::clamp(json_value(data, "speculative.n_tree", defaults.speculative.n_tree), 0, defaults.speculative.n_tree);
 
         params.speculative.n_min = std::min(params.speculative.n_max, params.speculative.n_min);
         params.speculative.n_min = std::max(params.speculative.n_min, 2);
@@ -421,8 +445,14 @@ struct result_timings {
     double predicted_per_token_ms;
     double predicted_per_second;
 
+    // speculative decoding, only reported if any tokens were drafted
+    int32_t draft_n          = 0;
+    int32_t draft_n_accepted = 0;
+    int32_t draft_n_steps    = 0;
+    double  draft_speedup    = 0.0; // estimated, relative to generating the same tokens one at a time
+
     json to_json() const {
-        return {
+        json base = {
             {"prompt_n",               prompt_n},
             {"prompt_ms",              prompt_ms},
             {"prompt_per_token_ms",    prompt_per_token_ms},
@@ -433,6 +463,16 @@ struct result_timings {
             {"predicted_per_token_ms", predicted_per_token_ms},
             {"predicted_per_second",   predicted_per_second},
         };
+
+        if (draft_n > 0) {
+            base["draft_n"]               = draft_n;
+            base["draft_n_accepted"]      = draft_n_accepted;
+            base["draft_acceptance_rate"] = (double) draft_n_accepted / draft_n;
+            base["draft_n_avg"]           = (double) draft_n / draft_n_steps;
+            base["draft_speedup"]         = draft_speedup;
+        }
+
+        return base;
     }
 };
 
@@ -451,6 +491,11 @@ struct server_task_result {
         return -1;
     }
     virtual json to_json() = 0;
+    // append the result to out as server-sent events, in the same bytes as to_json() passed to server_sent_event()
+    // returns false if there is no direct output for this result, to_json() has to be used then
+    virtual bool write_sse(std::string & /* out */) {
+        return false;
+    }
     virtual ~server_task_result() = default;
 };
 
@@ -744,7 +789,7 @@ struct server_task_result_cmpl_partial : server_task_result {
     int32_t n_prompt_tokens;
 
     bool post_sampling_probs;
-    completion_token_output prob_output;
+    std::vector<completion_token_output> probs_output;
     result_timings timings;
 
     // OAI-compat fields
@@ -761,6 +806,28 @@ struct server_task_result_cmpl_partial : server_task_result {
         return false; // in stream mode, partial responses are not considered stop
     }
 
+    // the first partial response of a chat completion also sends the role, it is never merged
+    bool can_merge(const server_task_result_cmpl_partial & next) const {
+        return id == next.id && index == next.index && n_decoded > 0 && next.n_decoded > 0;
+    }
+
+    // append the next partial response of the same task, both are sent as a single event
+    void merge(server_task_result_cmpl_partial && next) {
+        content += next.content;
+        tokens.insert(tokens.end(), next.tokens.begin(), next.tokens.end());
+
+        n_decoded       = next.n_decoded;
+        n_prompt_tokens = next.n_prompt_tokens;
+
+        for (auto & p : next.probs_output) {
+            probs_output.push_back(std::move(p));
+        }
+
+        if (next.timings.prompt_n >= 0) {
+            timings = next.timings;
+        }
+    }
+
     virtual json to_json() override {
         switch (oaicompat) {
             case OAICOMPAT_TYPE_NONE:
@@ -774,6 +841,113 @@ struct server_task_result_cmpl_partial : server_task_result {
         }
     }
 
+    // the keys are written in the order of the json objects of to_json()
+    virtual bool write_sse(std::string & out) override {
+        switch (oaicompat) {
+            case OAICOMPAT_TYPE_NONE:
+                write_sse_non_oaicompat(out);
+                return true;
+            case OAICOMPAT_TYPE_COMPLETION:
+                if (verbose) {
+                    return false;
+                }
+                write_sse_oaicompat(out);
+                return true;
+            case OAICOMPAT_TYPE_CHAT:
+                // the first response is sent in two parts
+                if (n_decoded == 0) {
+                    return false;
+                }
+                write_sse_oaicompat_chat(out);
+                return true;
+            default:
+                GGML_ASSERT(false && "Invalid oaicompat_type");
+        }
+    }
+
+    void write_sse_non_oaicompat(std::string & out) {
+        out += "data: {\"index\":";
+        json_write_int(out, index);
+        out += ",\"content\":";
+        json_write_string(out, content);
+        out += ",\"tokens\":[";
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (i > 0) {
+                out += ',';
+            }
+            json_write_int(out, tokens[i]);
+        }
+        out += "],\"stop\":false,\"id_slot\":";
+        json_write_int(out, id_slot);
+        out += ",\"tokens_predicted\":";
+        json_write_int(out, n_decoded);
+        out += ",\"tokens_evaluated\":";
+        json_write_int(out, n_prompt_tokens);
+        if (timings.prompt_n > 0) {
+            out += ",\"timings\":";
+            json_write_value(out, timings.to_json());
+        }
+        if (!probs_output.empty()) {
+            out += ",\"completion_probabilities\":";
+            json_write_value(out, completion_token_output::probs_vector_to_json(probs_output, post_sampling_probs));
+        }
+        out += "}\n\n";
+    }
+
+    void write_sse_oaicompat(std::string & out) {
+        out += "data: {\"choices\":[{\"text\":";
+        json_write_string(out, content);
+        out += ",\"index\":";
+        json_write_int(out, index);
+        out += ",\"logprobs\":";
+        if (!probs_output.empty()) {
+            out += "{\"content\":";
+            json_write_value(out, completion_token_output::probs_vector_to_json(probs_output, post_sampling_probs));
+            out += '}';
+        } else {
+            out += "null";
+        }
+        out += ",\"finish_reason\":null}],\"created\":";
+        json_write_int(out, std::time(0));
+        out += ",\"model\":";
+        json_write_string(out, oaicompat_model);
+        out += ",\"system_fingerprint\":";
+        json_write_string(out, build_info);
+        out += ",\"object\":\"text_completion\",\"id\":";
+        json_write_string(out, oaicompat_cmpl_id);
+        write_sse_timings(out);
+        out += "}\n\n";
+    }
+
+    void write_sse_oaicompat_chat(std::string & out) {
+        out += "data: {\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"content\":";
+        json_write_string(out, content);
+        out += '}';
+        if (!probs_output.empty()) {
+            out += ",\"logprobs\":{\"content\":";
+            json_write_value(out, completion_token_output::probs_vector_to_json(probs_output, post_sampling_probs));
+            out += '}';
+        }
+        out += "}],\"created\":";
+        json_write_int(out, std::time(0));
+        out += ",\"id\":";
+        json_write_string(out, oaicompat_cmpl_id);
+        out += ",\"model\":";
+        json_write_string(out, oaicompat_model);
+        out += ",\"system_fingerprint\":";
+        json_write_string(out, build_info);
+        out += ",\"object\":\"chat.completion.chunk\"";
+        write_sse_timings(out);
+        out += "}\n\n";
+    }
+
+    void write_sse_timings(std::string & out) {
+        if (timings.prompt_n >= 0) {
+            out += ",\"timings\":";
+            json_write_value(out, timings.to_json());
+        }
+    }
+
     json to_json_non_oaicompat() {
         // non-OAI-compat JSON
         json res = json {
@@ -789,8 +963,8 @@ struct server_task_result_cmpl_partial : server_task_result {
         if (timings.prompt_n > 0) {
             res.push_back({"timings", timings.to_json()});
         }
-        if (!prob_output.probs.empty()) {
-            res["completion_probabilities"] = completion_token_output::probs_vector_to_json({prob_output}, post_sampling_probs);
+        if (!probs_output.empty()) {
+            res["completion_probabilities"] = completion_token_output::probs_vector_to_json(probs_output, post_sampling_probs);
         }
         return res;
     }
@@ -798,9 +972,9 @@ struct server_task_result_cmpl_partial : server_task_result {
     json to_json_oaicompat() {
         std::time_t t = std::time(0);
         json logprobs = json(nullptr); // OAI default to null
-        if (prob_output.probs.size() > 0) {
+        if (!probs_output.empty()) {
             logprobs = json{
-                {"content", completion_token_output::probs_vector_to_json({prob_output}, post_sampling_probs)},
+                {"content", completion_token_output::probs_vector_to_json(probs_output, post_sampling_probs)},
             };
         }
         json res = json {
@@ -879,9 +1053,9 @@ struct server_task_result_cmpl_partial : server_task_result {
 
         GGML_ASSERT(choices.size() >= 1);
 
-        if (prob_output.probs.size() > 0) {
+        if (!probs_output.empty()) {
             choices[0]["logprobs"] = json{
-                {"content", completion_token_output::probs_vector_to_json({prob_output}, post_sampling_probs)},
+                {"content", completion_token_output::probs_vector_to_json(probs_output, post_sampling_probs)},
             };
         }
 
@@ -1034,6 +1208,18 @@ struct server_task_result_metrics : server_task_result {
 
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
+    uint64_t n_preempted_total  = 0;
+
+    uint64_t n_queued_cmpl_total = 0;
+    uint64_t t_queued_cmpl_total = 0;
+    uint64_t n_queued_embd_total = 0;
+    uint64_t t_queued_embd_total = 0;
+
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+    uint64_t n_draft_steps_total    = 0;
+    double   t_draft_spec_total     = 0.0;
+    double   t_draft_base_total     = 0.0;
 
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
@@ -1058,6 +1244,18 @@ struct server_task_result_metrics : server_task_result {
 
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
+            { "n_preempted_total",               n_preempted_total },
+
+            { "n_queued_cmpl_total",             n_queued_cmpl_total },
+            { "t_queued_cmpl_total",             t_queued_cmpl_total },
+            { "n_queued_embd_total",             n_queued_embd_total },
+            { "t_queued_embd_total",             t_queued_embd_total },
+
+            { "n_draft_total",                   n_draft_total },
+            { "n_draft_accepted_total",          n_draft_accepted_total },
+            { "n_draft_steps_total",             n_draft_steps_total },
+            { "t_draft_spec_total",              t_draft_spec_total },
+            { "t_draft_base_total",              t_draft_base_total },
 
             { "kv_cache_tokens_count",           kv_cache_tokens_count },
             { "kv_cache_used_cells",             kv_cache_used_cells },
@@ -1117,19 +1315,143 @@ struct server_task_result_apply_lora : server_task_result {
     }
 };
 
-struct server_slot {
-    int id;
+// picks the length of each speculative draft of a slot, so that the expected number of generated tokens per second is
+// the highest for the observed acceptance rate and the measured cost of drafting and of verifying
+// the estimates are decayed moving averages, they are kept across the tasks of the slot since the costs depend on the
+// hardware and the models, and the acceptance rate adapts within a few steps
+struct server_draft_controller {
+    // weight of the history in the moving averages
+    static constexpr double decay = 0.9;
+
+    // steps with the longest possible draft before the estimates are used
+    static constexpr int n_warmup = 4;
+
+    // when speculation does not pay off, a short draft is still verified every n_probe steps to update the estimates
+    static constexpr int n_probe = 16;
+
+    int n_steps   = 0;
+    int n_skipped = 0;
+
+    // decayed number of draft tokens that were checked by the target model and of those that were accepted
+    // a draft is checked up to its first rejected token
+    double n_checked  = 0.0;
+    double n_accepted = 0.0;
+
+    // time to draft one token, ms
+    double t_draft = 0.0;
+
+    // decayed sums of the linear fit t_verify(n_batch) = t0 + t1*n_batch, ms
+    double s_w  = 0.0;
+    double s_n  = 0.0;
+    double s_t  = 0.0;
+    double s_nn = 0.0;
+    double s_nt = 0.0;
+
+    // probability that a draft token is accepted, given that the previous ones were
+    double acceptance() const {
+        return n_checked > 0.0 ? n_accepted / n_checked : 0.0;
+    }
+
+    // expected time of a decode of n_batch tokens of the slot, ms
+    double t_verify(int n_batch) const {
+        if (s_w <= 0.0) {
+            return 0.0;
+        }
+
+        const double mean_n = s_n / s_w;
+        const double mean_t = s_t / s_w;
+        const double var_n  = s_nn / s_w - mean_n*mean_n;
+
+        // without different batch sizes, assume that decoding is memory bound and the cost does not depend on the size
+        double t1 = var_n > 0.25 ? (s_nt / s_w - mean_n*mean_t) / var_n : 0.0;
+        t1 = std::max(t1, 0.0);
+
+        const double t0 = std::max(mean_t - t1*mean_n, 0.0);
+
+        return t0 + t1*n_batch;
+    }
+
+    // expected number of generated tokens of a step with a draft of n_draft tokens, including the sampled one
+    static double n_expected(double alpha, int n_draft) {
+        if (alpha >= 1.0) {
+            return n_draft + 1;
+        }
+        return (1.0 - std::pow(alpha, n_draft + 1)) / (1.0 - alpha);
+    }
+
+    // returns 0 if this step should not speculate
+    int get_n_draft(int n_min, int n_max) {
+        if (n_steps < n_warmup) {
+            return n_max;
+        }
+
+        const double alpha = acceptance();
+
+        // without speculation, one token per single token decode
+        double best_rate = 1.0 / std::max(t_verify(1), 1e-3);
+        int    best_n    = 0;
+
+        for (int n = n_min; n <= n_max; ++n) {
+            const double rate = n_expected(alpha, n) / std::max(n*t_draft + t_verify(n + 1), 1e-3);
+            if (rate > best_rate) {
+                best_rate = rate;
+                best_n    = n;
+            }
+        }
+
+        if (best_n == 0) {
+            if (++n_skipped < n_probe) {
+                return 0;
+            }
+            best_n = n_min;
+        }
+
+        n_skipped = 0;
+
+        return best_n;
+    }
+
+    void on_draft(int n_draft, double t_ms) {
+        if (n_draft > 0) {
+            t_draft = n_steps == 0 ? t_ms / n_draft : decay*t_draft + (1.0 - decay)*t_ms / n_draft;
+        }
+    }
+
+    void on_verify(int n_draft, int n_draft_accepted, double t_ms) {
+        n_checked  = decay*n_checked  + n_draft_accepted + (n_draft_accepted < n_draft ? 1 : 0);
+        n_accepted = decay*n_accepted + n_draft_accepted;
+
+        const double n_batch = n_draft + 1;
+
+        s_w  = decay*s_w  + 1.0;
+        s_n  = decay*s_n  + n_batch;
+        s_t  = decay*s_t  + t_ms;
+        s_nn = decay*s_nn + n_batch*n_batch;
+        s_nt = decay*s_nt + n_batch*t_ms;
+
+        n_steps++;
+    }
+};
+
+struct server_disk_cache_read;
+
+// state of the request processed by a slot, separate from the resources owned by the slot (contexts, caches, scratch
+// buffers), so that a preempted request can be saved and later resumed in any slot by moving only this part
+struct server_slot_request {
     int id_task = -1;
 
     // only used for completion/embedding/infill/rerank
     server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
 
-    llama_batch batch_spec = {};
+    // draft tokens of the current task and how many of them were accepted
+    int32_t n_draft_total    = 0;
+    int32_t n_draft_accepted = 0;
+    int32_t n_draft_steps    = 0; // number of verified drafts
 
-    llama_context * ctx = nullptr;
-    llama_context * ctx_dft = nullptr;
-
-    common_speculative * spec = nullptr;
+    // time of the speculative steps (drafting and verification), and the estimated time to generate the same tokens
+    // one at a time, ms
+    double t_draft_spec = 0.0;
+    double t_draft_base = 0.0;
 
     std::vector<common_lora_adapter_info> lora;
 
@@ -1140,11 +1462,7 @@ struct server_slot {
 
     slot_state state = SLOT_STATE_IDLE;
 
-    // used to determine the slot that has been used the longest
-    int64_t t_last_used = -1;
-
     // generation props
-    int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
     int32_t n_decoded   = 0;
     int32_t n_remaining = -1;
@@ -1160,11 +1478,13 @@ struct server_slot {
 
     size_t last_nl_pos = 0;
 
+    // generated_text is only appended to while the slot is generating, these are positions in it
+    size_t n_text_valid  = 0; // end of the last complete UTF-8 character
+    size_t n_nl_searched = 0; // end of the text searched for new lines
+
     std::string  generated_text;
     llama_tokens generated_tokens;
 
-    llama_tokens cache_tokens;
-
     std::vector<completion_token_output> generated_token_probs;
 
     bool has_next_token = true;
@@ -1174,6 +1494,9 @@ struct server_slot {
 
     std::string stopping_word;
 
+    // fed with generated_text, built from params.antiprompt when the slot is launched
+    stop_string_matcher stop_matcher;
+
     // sampling
     json json_schema;
 
@@ -1184,11 +1507,48 @@ struct server_slot {
     // stats
     size_t n_sent_text        = 0; // number of sent text character
 
+    int64_t t_queued;
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
     double t_prompt_processing; // ms
     double t_token_generation;  // ms
+};
+
+struct server_slot : server_slot_request {
+    int id;
+
+    llama_context * ctx = nullptr;
+    llama_context * ctx_dft = nullptr;
+
+    common_speculative * spec = nullptr;
+
+    // n-gram cache of cache_tokens, used to draft without a draft model (speculative.ngram)
+    common_ngram_cache ngram_cache;
+    size_t n_ngram_cache = 0; // number of leading tokens of cache_tokens in ngram_cache
+
+    server_draft_controller draft_controller;
+
+    // state read from the slot cache in the background for the prompt of the task, see --slot-cache-path
+    std::shared_ptr<server_disk_cache_read> disk_read;
+
+    // used to determine the slot that has been used the longest
+    int64_t t_last_used = -1;
+
+    int32_t n_ctx = 0; // context size per slot
+
+    llama_tokens cache_tokens;
+
+    // index of cache_tokens used to select a slot by prompt similarity
+    // appended tokens are indexed by update_cache_index(), any other modification of cache_tokens must clear it
+    token_suffix_automaton cache_index;
+
+    // number of leading KV cells of this slot that may also belong to other slots (see server_prefix_cache)
+    // these cells must not be shifted, otherwise the positions of the other slots are shifted as well
+    int32_t n_kv_shared = 0;
+
+    // reused by populate_token_probs() to avoid an allocation per token
+    std::vector<llama_token_data> probs_scratch;
 
     std::function<void(int)> callback_on_release;
 
@@ -1197,6 +1557,8 @@ struct server_slot {
 
         n_prompt_tokens    = 0;
         last_nl_pos        = 0;
+        n_text_valid       = 0;
+        n_nl_searched      = 0;
         generated_text     = "";
         has_new_line       = false;
         truncated          = false;
@@ -1205,18 +1567,30 @@ struct server_slot {
         n_past             = 0;
         n_sent_text        = 0;
         task_type          = SERVER_TASK_TYPE_COMPLETION;
+        n_draft_total      = 0;
+        n_draft_accepted   = 0;
+        n_draft_steps      = 0;
+        t_draft_spec       = 0.0;
+        t_draft_base       = 0.0;
 
         generated_tokens.clear();
         generated_token_probs.clear();
+
+        stop_matcher.reset();
+
+        ngram_cache.clear();
+        n_ngram_cache = 0;
+
+        disk_read.reset();
     }
 
     bool is_non_causal() const {
         return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
     }
 
+    // slots with different LoRA adapters can share a batch, it is decoded in one group per adapter set
     bool can_batch_with(server_slot & other_slot) {
-        return is_non_causal() == other_slot.is_non_causal()
-            && are_lora_equal(lora, other_slot.lora);
+        return is_non_causal() == other_slot.is_non_causal();
     }
 
     bool has_budget(const common_params & global_params) {
@@ -1240,7 +1614,17 @@ struct server_slot {
     }
 
     bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+        return (ctx_dft || params.speculative.ngram) && params.speculative.n_max > 0 && params.cache_prompt;
+    }
+
+    void update_cache_index() {
+        if (cache_index.size() > cache_tokens.size()) {
+            cache_index.clear();
+        }
+
+        for (size_t i = cache_index.size(); i < cache_tokens.size(); ++i) {
+            cache_index.push_back(cache_tokens[i]);
+        }
     }
 
     void add_token(const completion_token_output & token) {
@@ -1258,6 +1642,7 @@ struct server_slot {
             t_last_used = ggml_time_us();
             t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
             state = SLOT_STATE_IDLE;
+            disk_read.reset();
             callback_on_release(id);
         }
     }
@@ -1274,33 +1659,33 @@ struct server_slot {
         timings.predicted_per_token_ms = t_token_generation / n_decoded;
         timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
 
+        timings.draft_n          = n_draft_total;
+        timings.draft_n_accepted = n_draft_accepted;
+        timings.draft_n_steps    = n_draft_steps;
+        timings.draft_speedup    = t_draft_spec > 0.0 ? t_draft_base / t_draft_spec : 0.0;
+
         return timings;
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
+    // position in generated_text of a stop word that starts at pos or after, only the text appended since the
+    // previous full stop search is scanned
+    size_t find_stopping_strings(const size_t pos, bool is_full_stop) {
+        if (stop_matcher.empty()) {
+            return std::string::npos;
+        }
 
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+        if (!is_full_stop) {
+            // otherwise, partial stop
+            return stop_matcher.find_partial(pos);
+        }
 
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = find_partial_stop_string(word, text);
-            }
+        int32_t word = -1;
 
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
+        const size_t stop_pos = stop_matcher.feed(generated_text, pos, word);
+        if (stop_pos != std::string::npos) {
+            stop           = STOP_TYPE_WORD;
+            stopping_word  = params.antiprompt[word];
+            has_next_token = false;
         }
 
         return stop_pos;
@@ -1321,6 +1706,12 @@ struct server_slot {
                 t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
                 t_token_generation, n_decoded, t_gen, n_gen_second,
                 t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_draft_total > 0) {
+            SLT_INF(*this, "draft acceptance rate = %0.5f (%5d accepted / %5d generated), average draft = %0.2f, estimated speedup = %0.2f\n",
+                    (double) n_draft_accepted / n_draft_total, n_draft_accepted, n_draft_total,
+                    (double) n_draft_total / n_draft_steps, t_draft_spec > 0.0 ? t_draft_base / t_draft_spec : 0.0);
+        }
     }
 
     json to_json() const {
@@ -1362,6 +1753,20 @@ struct server_metrics {
 
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
+    uint64_t n_preempted_total  = 0;
+
+    // time from the creation of a task to the start of its prompt processing, for completions and embeddings/reranks
+    uint64_t n_queued_cmpl_total = 0;
+    uint64_t t_queued_cmpl_total = 0; // us
+    uint64_t n_queued_embd_total = 0;
+    uint64_t t_queued_embd_total = 0; // us
+
+    // speculative decoding of the finished completions
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+    uint64_t n_draft_steps_total    = 0;
+    double   t_draft_spec_total     = 0.0; // ms
+    double   t_draft_base_total     = 0.0; // ms, estimated time without speculation
 
     void init() {
         t_start = ggml_time_us();
@@ -1374,11 +1779,28 @@ struct server_metrics {
         t_prompt_processing_total       += slot.t_prompt_processing;
     }
 
+    void on_prompt_start(const server_slot & slot) {
+        const uint64_t t_queued = slot.t_start_process_prompt - slot.t_queued;
+        if (slot.is_non_causal()) {
+            n_queued_embd_total++;
+            t_queued_embd_total += t_queued;
+        } else {
+            n_queued_cmpl_total++;
+            t_queued_cmpl_total += t_queued;
+        }
+    }
+
     void on_prediction(const server_slot & slot) {
         n_tokens_predicted_total   += slot.n_decoded;
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+
+        n_draft_total          += slot.n_draft_total;
+        n_draft_accepted_total += slot.n_draft_accepted;
+        n_draft_steps_total    += slot.n_draft_steps;
+        t_draft_spec_total     += slot.t_draft_spec;
+        t_draft_base_total     += slot.t_draft_base;
     }
 
     void on_decoded(const std::vector<server_slot> & slots) {
@@ -1398,206 +1820,851 @@ struct server_metrics {
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// radix tree of the token prefixes that are currently stored in the KV cache, shared by all slots
+// each slot (i.e. KV sequence) owns at most one path from the root - a new slot can copy the KV cells
+// of the longest matching path with llama_kv_cache_seq_cp() instead of evaluating the prompt again
+// only tokens that have already been decoded are inserted, so a match is always safe to copy
+struct server_prefix_cache {
+    struct node {
+        llama_tokens tokens; // the tokens on the edge from the parent to this node
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        int parent = -1;
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        std::vector<int> owners; // ids of the slots that hold the full path up to the end of this node
 
-    // callback functions
-    std::function<void(server_task)> callback_new_task;
-    std::function<void(void)>        callback_update_slots;
+        std::unordered_map<llama_token, int> children; // keyed by the first token of the child edge
+    };
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        QUE_DBG("new task, id = %{public}d, front = %{public}d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+    std::vector<node> nodes = { node() }; // nodes[0] is the root
+    std::vector<int>  nodes_free;
+
+    // the sequence that is currently indexed for each slot
+    std::unordered_map<int, llama_tokens> seqs;
+
+    // index the first n tokens of the KV sequence of the given slot (replaces any previous entry)
+    void insert(int id_slot, const llama_tokens & tokens, size_t n) {
+        remove(id_slot);
+
+        n = std::min(n, tokens.size());
+        if (n == 0) {
+            return;
         }
-        condition_tasks.notify_one();
-        return task.id;
-    }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
+        seqs[id_slot] = llama_tokens(tokens.begin(), tokens.begin() + n);
+
+        int    cur = 0;
+        size_t i   = 0;
+
+        while (i < n) {
+            const auto it = nodes[cur].children.find(tokens[i]);
+            if (it == nodes[cur].children.end()) {
+                const int id_new = alloc(cur, llama_tokens(tokens.begin() + i, tokens.begin() + n));
+                nodes[id_new].owners.push_back(id_slot);
+                nodes[cur].children[tokens[i]] = id_new;
+                return;
             }
-            QUE_DBG("new task, id = %{public}d/%{public}d, front = %{public}d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
+
+            int child = it->second;
+
+            const size_t n_match = match(nodes[child].tokens, tokens, i, n);
+            if (n_match < nodes[child].tokens.size()) {
+                child = split(child, n_match);
             }
+
+            nodes[child].owners.push_back(id_slot);
+
+            i  += n_match;
+            cur = child;
         }
-        condition_tasks.notify_one();
-        return 0;
     }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %{public}d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+    // keep only the first n tokens of the given slot - call this before the KV cells after n are modified
+    void truncate(int id_slot, size_t n) {
+        const auto it = seqs.find(id_slot);
+        if (it == seqs.end() || it->second.size() <= n) {
+            return;
+        }
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        const llama_tokens tokens = it->second;
+        insert(id_slot, tokens, n);
     }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task)> callback) {
-        callback_new_task = std::move(callback);
-    }
+    void remove(int id_slot) {
+        const auto it = seqs.find(id_slot);
+        if (it == seqs.end()) {
+            return;
+        }
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
-    }
+        const llama_tokens tokens = std::move(it->second);
+        seqs.erase(it);
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+        std::vector<int> path;
+
+        int    cur = 0;
+        size_t i   = 0;
+
+        while (i < tokens.size()) {
+            cur = nodes[cur].children.at(tokens[i]);
+
+            auto & owners = nodes[cur].owners;
+            owners.erase(std::remove(owners.begin(), owners.end(), id_slot), owners.end());
+
+            path.push_back(cur);
+            i += nodes[cur].tokens.size();
+        }
+
+        // the owners of a node are a subset of the owners of its parent, so we can prune bottom-up
+        for (auto it_path = path.rbegin(); it_path != path.rend(); ++it_path) {
+            node & nd = nodes[*it_path];
+            if (!nd.owners.empty()) {
+                break;
+            }
+
+            nodes[nd.parent].children.erase(nd.tokens[0]);
+            nd = node();
+            nodes_free.push_back(*it_path);
         }
-        condition_tasks.notify_one();
     }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+    void clear() {
+        nodes = { node() };
+        nodes_free.clear();
+        seqs.clear();
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+    // find the longest indexed prefix of tokens that is held by a slot accepted by the filter
+    // returns the id of that slot (or -1) and the length of the prefix
+    std::pair<int, size_t> find(const llama_tokens & tokens, const std::function<bool(int)> & filter) const {
+        std::pair<int, size_t> best = { -1, 0 };
 
-        while (true) {
-            QUE_DBG("%{public}s", "processing new tasks\n");
+        int    cur = 0;
+        size_t i   = 0;
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
+        while (i < tokens.size()) {
+            const auto it = nodes[cur].children.find(tokens[i]);
+            if (it == nodes[cur].children.end()) {
+                break;
+            }
+
+            const node & nd = nodes[it->second];
 
-                QUE_DBG("processing task, id = %{public}d\n", task.id);
-                callback_new_task(std::move(task));
+            const auto owner = std::find_if(nd.owners.begin(), nd.owners.end(), filter);
+            if (owner == nd.owners.end()) {
+                // deeper nodes can only have fewer owners
+                break;
             }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%{public}s", "update slots\n");
+            const size_t n_match = match(nd.tokens, tokens, i, tokens.size());
 
-            callback_update_slots();
+            best = { *owner, i + n_match };
 
-            QUE_DBG("%{public}s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        QUE_DBG("%{public}s", "terminate\n");
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
+            if (n_match < nd.tokens.size()) {
+                break;
             }
+
+            i  += n_match;
+            cur = it->second;
         }
+
+        return best;
     }
-};
 
-struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+private:
+    int alloc(int parent, llama_tokens && tokens) {
+        int id;
+        if (!nodes_free.empty()) {
+            id = nodes_free.back();
+            nodes_free.pop_back();
+        } else {
+            id = nodes.size();
+            nodes.emplace_back();
+        }
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+        nodes[id].parent = parent;
+        nodes[id].tokens = std::move(tokens);
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+        return id;
+    }
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %{public}d to waiting list. current waiting = %{public}d (before add)\n", id_task, (int) waiting_task_ids.size());
+    // split the edge of node id after n tokens, returns the id of the new (upper) node
+    int split(int id, size_t n) {
+        const int parent = nodes[id].parent;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
-    }
+        const int id_mid = alloc(parent, llama_tokens(nodes[id].tokens.begin(), nodes[id].tokens.begin() + n));
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        nodes[id_mid].owners = nodes[id].owners;
+        nodes[id_mid].children[nodes[id].tokens[n]] = id;
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %{public}d to waiting list. current waiting = %{public}d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
-        }
-    }
+        nodes[parent].children[nodes[id_mid].tokens[0]] = id_mid;
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %{public}d from waiting list. current waiting = %{public}d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        nodes[id].tokens.erase(nodes[id].tokens.begin(), nodes[id].tokens.begin() + n);
+        nodes[id].parent = id_mid;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        return id_mid;
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    // number of leading tokens of the edge that match tokens[i, n)
+    static size_t match(const llama_tokens & edge, const llama_tokens & tokens, size_t i, size_t n) {
+        size_t n_match = 0;
+        while (n_match < edge.size() && i + n_match < n && edge[n_match] == tokens[i + n_match]) {
+            n_match++;
+        }
+        return n_match;
+    }
+};
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %{public}d from waiting list. current waiting = %{public}d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+// a state read from the slot cache by the background thread, see server_disk_cache::prefetch()
+struct server_disk_cache_read {
+    std::string path;
+    size_t      n_bytes_file = 0;
+
+    std::atomic<bool> done = false;
+    bool              ok   = false;
+
+    llama_tokens         tokens;
+    std::vector<uint8_t> state;
+};
+
+// on-disk tier of the KV cache
+// the state of the sequences evicted from the slots is written to a bounded directory, keyed by the hash of their
+// tokens, so that a later prompt that starts with the same tokens can load it instead of evaluating them again
+// the state is copied in and out of the context by the caller, the files are written and read by a background thread
+struct server_disk_cache {
+    static constexpr uint32_t magic   = 0x4344564b; // "KVDC"
+    static constexpr uint32_t version = 1;
+
+    // shorter sequences are cheaper to evaluate again than to load
+    static constexpr size_t n_tokens_min = 64;
+
+    // states that are waiting to be written are kept in memory, drop new ones beyond this
+    static constexpr size_t n_pending_max = 2;
+
+    struct entry {
+        llama_tokens       tokens;
+        std::vector<float> lora; // the scales of the adapters the state was computed with
+
+        size_t  n_bytes;
+        int64_t t_last_used;
+
+        bool ready; // the file has been written
+    };
+
+    struct job {
+        uint64_t key;
+        std::vector<uint8_t> state;
+    };
+
+    ~server_disk_cache() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_all();
+
+        if (worker.joinable()) {
+            worker.join();
         }
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+    // the fingerprint identifies the model and context the states belong to, files written with another one are removed
+    bool init(const std::string & path, size_t n_bytes_max, const std::string & fingerprint) {
+        dir = path;
+        if (!dir.empty() && dir.back() != DIRECTORY_SEPARATOR) {
+            dir += DIRECTORY_SEPARATOR;
+        }
+
+        if (!fs_create_directory_with_parents(dir)) {
+            return false;
+        }
+
+        this->n_bytes_max = n_bytes_max;
+        this->fingerprint = fingerprint;
+
+        // pick up the files of a previous run
+        std::error_code ec;
+        for (const auto & file : std::filesystem::directory_iterator(dir, ec)) {
+            const std::string name = file.path().filename().string();
+            if (!file.is_regular_file() || name.size() != 20 || name.compare(16, 4, ".kvc") != 0) {
+                continue;
+            }
+
+            entry e;
+            if (!read_header(file.path().string(), e) || e.tokens.empty()) {
+                std::filesystem::remove(file.path(), ec);
+                continue;
+            }
+
+            e.n_bytes     = file.file_size(ec);
+            e.t_last_used = 0;
+            e.ready       = true;
+
+            const uint64_t key = hash(e.tokens, e.lora);
+            if (name != filename(key)) {
+                std::filesystem::remove(file.path(), ec);
+                continue;
+            }
+
+            n_bytes += e.n_bytes;
+            entries[key] = std::move(e);
+        }
+
+        evict();
+
+        running = true;
+        worker  = std::thread(&server_disk_cache::loop, this);
+
+        return true;
+    }
+
+    bool contains(const llama_tokens & tokens, const std::vector<float> & lora) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return entries.find(hash(tokens, lora)) != entries.end();
+    }
+
+    // queue the state of a sequence to be written to disk
+    void store(const llama_tokens & tokens, const std::vector<float> & lora, std::vector<uint8_t> && state) {
+        const uint64_t key = hash(tokens, lora);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            const auto it = entries.find(key);
+            if (it != entries.end()) {
+                it->second.t_last_used = ggml_time_us();
+                return;
+            }
+
+            if (jobs.size() >= n_pending_max) {
+                return;
+            }
+
+            entries[key] = { tokens, lora, state.size(), ggml_time_us(), false };
+            n_bytes += state.size();
+
+            jobs.push_back({ key, std::move(state) });
+
+            evict();
+        }
+
+        condition.notify_one();
+    }
+
+    // start reading the stored state that shares the longest prefix with tokens, if that prefix has at least n_min
+    // tokens; the file is read by the background thread, returns nullptr if there is no such state
+    std::shared_ptr<server_disk_cache_read> prefetch(const llama_tokens & tokens, const std::vector<float> & lora, size_t n_min) {
+        auto rd = std::make_shared<server_disk_cache_read>();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            entry * best = nullptr;
+            for (auto & it : entries) {
+                if (!it.second.ready || it.second.lora != lora) {
+                    continue;
+                }
+
+                const size_t n_match = common_lcp(it.second.tokens, tokens);
+                if (n_match >= n_min) {
+                    n_min = n_match + 1;
+                    best  = &it.second;
+
+                    rd->path         = dir + filename(it.first);
+                    rd->n_bytes_file = it.second.n_bytes;
+                }
+            }
+
+            if (best == nullptr) {
+                return nullptr;
+            }
+
+            best->t_last_used = ggml_time_us();
+
+            reads.push_back(rd);
+        }
+
+        condition.notify_one();
+
+        return rd;
+    }
+
+    // wait at most t_max_ms for a read to complete
+    void wait(const server_disk_cache_read & rd, int64_t t_max_ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_read.wait_for(lock, std::chrono::milliseconds(t_max_ms), [&] { return rd.done.load(); });
+    }
+
+private:
+    std::string dir;
+    std::string fingerprint;
+
+    size_t n_bytes_max = 0;
+    size_t n_bytes     = 0;
+
+    std::unordered_map<uint64_t, entry> entries;
+
+    std::deque<job> jobs;
+
+    std::deque<std::shared_ptr<server_disk_cache_read>> reads;
+
+    bool running = false;
+
+    std::mutex              mutex;
+    std::condition_variable condition;
+    std::condition_variable condition_read;
+    std::thread             worker;
+
+    static uint64_t hash(const llama_tokens & tokens, const std::vector<float> & lora) {
+        // FNV-1a
+        uint64_t h = 0xcbf29ce484222325ull;
+        const auto add = [&](const void * data, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                h ^= static_cast<const uint8_t *>(data)[i];
+                h *= 0x100000001b3ull;
+            }
+        };
+        add(tokens.data(), tokens.size() * sizeof(llama_token));
+        add(lora.data(),   lora.size()   * sizeof(float));
+        return h;
+    }
+
+    static std::string filename(uint64_t key) {
+        return string_format("%016" PRIx64 ".kvc", key);
+    }
+
+    bool read_header(const std::string & path, entry & e) const {
+        std::ifstream file(path, std::ios::binary);
+        return read_header(file, e);
+    }
+
+    bool read_header(std::ifstream & file, entry & e) const {
+        uint32_t hdr[2] = { 0, 0 };
+        file.read(reinterpret_cast<char *>(hdr), sizeof(hdr));
+        if (!file || hdr[0] != magic || hdr[1] != version) {
+            return false;
+        }
+
+        // sanity limit for the sizes below, the files may be corrupted
+        const uint32_t n_max = 1u << 26;
+
+        uint32_t n = 0;
+
+        file.read(reinterpret_cast<char *>(&n), sizeof(n));
+        if (!file || n != fingerprint.size()) {
+            return false;
+        }
+        std::string fp(n, '\0');
+        file.read(&fp[0], fp.size());
+        if (!file || fp != fingerprint) {
+            return false;
+        }
+
+        file.read(reinterpret_cast<char *>(&n), sizeof(n));
+        if (!file || n > n_max) {
+            return false;
+        }
+        e.lora.resize(n);
+        file.read(reinterpret_cast<char *>(e.lora.data()), e.lora.size() * sizeof(float));
+
+        file.read(reinterpret_cast<char *>(&n), sizeof(n));
+        if (!file || n > n_max) {
+            return false;
+        }
+        e.tokens.resize(n);
+        file.read(reinterpret_cast<char *>(e.tokens.data()), e.tokens.size() * sizeof(llama_token));
+
+        return (bool) file;
+    }
+
+    // the file may be evicted in the meantime, reading it fails in that case
+    bool read_state(server_disk_cache_read & rd) const {
+        entry e;
+        std::ifstream file(rd.path, std::ios::binary);
+        if (!read_header(file, e)) {
+            return false;
+        }
+
+        uint64_t n_state = 0;
+        file.read(reinterpret_cast<char *>(&n_state), sizeof(n_state));
+        if (!file || n_state > rd.n_bytes_file) {
+            return false;
+        }
+        rd.state.resize(n_state);
+        file.read(reinterpret_cast<char *>(rd.state.data()), n_state);
+        if (!file) {
+            return false;
+        }
+
+        rd.tokens = std::move(e.tokens);
+
+        return true;
+    }
+
+    // remove the least recently used files until the cache fits in its budget (mutex must be held)
+    void evict() {
+        while (n_bytes > n_bytes_max) {
+            auto lru = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.ready && (lru == entries.end() || it->second.t_last_used < lru->second.t_last_used)) {
+                    lru = it;
+                }
+            }
+
+            if (lru == entries.end()) {
+                break; // only pending entries left
+            }
+
+            std::error_code ec;
+            std::filesystem::remove(dir + filename(lru->first), ec);
+
+            n_bytes -= lru->second.n_bytes;
+            entries.erase(lru);
+        }
+    }
+
+    void loop() {
         while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+            job j;
+            entry e;
+
+            std::shared_ptr<server_disk_cache_read> rd;
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&] { return !jobs.empty() || !reads.empty() || !running; });
+
+                if (jobs.empty() && reads.empty()) {
+                    return;
                 }
+
+                // a prompt is waiting for the reads, they go first
+                if (!reads.empty()) {
+                    rd = std::move(reads.front());
+                    reads.pop_front();
+                } else {
+                    j = std::move(jobs.front());
+                    jobs.pop_front();
+
+                    e = entries.at(j.key);
+                }
+            }
+
+            if (rd) {
+                rd->ok = read_state(*rd);
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    rd->done = true;
+                }
+                condition_read.notify_all();
+
+                continue;
+            }
+
+            const std::string path = dir + filename(j.key);
+
+            bool ok;
+            {
+                // write to a temporary file first, so that a partial file is never picked up
+                std::ofstream file(path + ".tmp", std::ios::binary | std::ios::trunc);
+
+                const uint32_t hdr[2] = { magic, version };
+                file.write(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+
+                uint32_t n = fingerprint.size();
+                file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+                file.write(fingerprint.data(), n);
+
+                n = e.lora.size();
+                file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+                file.write(reinterpret_cast<const char *>(e.lora.data()), n * sizeof(float));
+
+                n = e.tokens.size();
+                file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+                file.write(reinterpret_cast<const char *>(e.tokens.data()), n * sizeof(llama_token));
+
+                const uint64_t n_state = j.state.size();
+                file.write(reinterpret_cast<const char *>(&n_state), sizeof(n_state));
+                file.write(reinterpret_cast<const char *>(j.state.data()), n_state);
+
+                ok = (bool) file.flush();
+            }
+
+            // renamed with the lock held, the file is only visible once its entry can be read
+            std::unique_lock<std::mutex> lock(mutex);
+
+            std::error_code ec;
+            if (ok) {
+                std::filesystem::rename(path + ".tmp", path, ec);
+                ok = !ec;
+            }
+
+            auto it = entries.find(j.key);
+            if (ok) {
+                const size_t n_bytes_file = std::filesystem::file_size(path, ec);
+
+                n_bytes -= it->second.n_bytes;
+                n_bytes += n_bytes_file;
+
+                it->second.n_bytes = n_bytes_file;
+                it->second.ready   = true;
+
+                evict();
+            } else {
+                SRV_WRN("failed to write the slot cache file '%{public}s'\n", path.c_str());
+
+                std::filesystem::remove(path + ".tmp", ec);
+
+                n_bytes -= it->second.n_bytes;
+                entries.erase(it);
             }
         }
+    }
+};
+
+struct server_queue {
+    std::atomic<int>  id      = 0;
+    std::atomic<bool> running = false;
 
-        // should never reach here
+    // queues
+    // tasks are posted by the HTTP threads without taking a lock, only the main loop consumes them
+    mpsc_queue<server_task> queue_tasks{1024};
+
+    // the deferred tasks are only accessed by the main loop
+    // queue_tasks_deferred is ordered by priority, FIFO for the same priority
+    std::deque<server_task> queue_tasks_deferred;
+    std::deque<server_task> queue_tasks_resumed;
+
+    // set by callback_update_slots when there is more work to do
+    bool has_next_response = false;
+
+    // callback functions
+    std::function<void(server_task)> callback_new_task;
+    std::function<void(void)>        callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task task) {
+        GGML_ASSERT(task.id != -1);
+        QUE_DBG("new task, id = %{public}d\n", task.id);
+        const int id_task = task.id;
+        queue_tasks.push(std::move(task));
+        return id_task;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> & tasks) {
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            QUE_DBG("new task, id = %{public}d/%{public}d\n", task.id, (int) tasks.size());
+            queue_tasks.push(std::move(task));
+        }
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    // must be called from the main loop
+    void defer(server_task task) {
+        QUE_DBG("defer task, id = %{public}d, priority = %{public}d\n", task.id, task.params.priority);
+        const auto it = std::find_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [&](const server_task & t) {
+            return t.params.priority < task.params.priority;
+        });
+        queue_tasks_deferred.insert(it, std::move(task));
+    }
+
+    // Remove a deferred task that was cancelled
+    // must be called from the main loop
+    void remove_deferred_task(int id_task) {
+        for (auto * queue : { &queue_tasks_deferred, &queue_tasks_resumed }) {
+            queue->erase(std::remove_if(queue->begin(), queue->end(), [&](const server_task & t) {
+                return t.id == id_task;
+            }), queue->end());
+        }
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        return id++;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // must be called from the main loop
+    void pop_deferred_task() {
+        if (!queue_tasks_deferred.empty()) {
+            queue_tasks_resumed.emplace_back(std::move(queue_tasks_deferred.front()));
+            queue_tasks_deferred.pop_front();
+        }
+    }
+
+    // Call from callback_update_slots to run the next iteration without waiting for new tasks
+    void next_response() {
+        has_next_response = true;
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        running = false;
+        queue_tasks.notify(true);
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%{public}s", "processing new tasks\n");
+
+            while (true) {
+                if (!queue_tasks_resumed.empty()) {
+                    server_task task = std::move(queue_tasks_resumed.front());
+                    queue_tasks_resumed.pop_front();
+
+                    QUE_DBG("processing deferred task, id = %{public}d\n", task.id);
+                    callback_new_task(std::move(task));
+                    continue;
+                }
+
+                std::optional<server_task> task = queue_tasks.try_pop();
+                if (!task) {
+                    break;
+                }
+
+                QUE_DBG("processing task, id = %{public}d\n", task->id);
+                callback_new_task(std::move(*task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%{public}s", "update slots\n");
+
+            has_next_response = false;
+
+            callback_update_slots();
+
+            if (has_next_response || !queue_tasks_resumed.empty()) {
+                continue;
+            }
+
+            QUE_DBG("%{public}s", "waiting for new tasks\n");
+            if (queue_tasks.empty()) {
+                if (!running) {
+                    QUE_DBG("%{public}s", "terminate\n");
+                    return;
+                }
+                queue_tasks.wait([&]{
+                    return !running;
+                });
+            }
+        }
+    }
+};
+
+// results of the tasks of a single request, consumed by the HTTP thread handling the request
+struct server_response_channel {
+    std::deque<server_task_result_ptr> queue_results;
+
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+};
+
+using server_response_channel_ptr = std::shared_ptr<server_response_channel>;
+
+struct server_response {
+    // for keeping track of all tasks waiting for the result, and the channel their results are sent to
+    // the tasks of a multitask share the same channel
+    std::unordered_map<int, server_response_channel_ptr> waiting_tasks;
+
+    // only protects waiting_tasks, the results are synchronized by their channel
+    std::mutex mutex_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %{public}d to waiting list. current waiting = %{public}d (before add)\n", id_task, (int) waiting_tasks.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_tasks[id_task] = std::make_shared<server_response_channel>();
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        auto channel = std::make_shared<server_response_channel>();
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %{public}d to waiting list. current waiting = %{public}d (before add)\n", task.id, (int) waiting_tasks.size());
+            waiting_tasks[task.id] = channel;
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %{public}d from waiting list. current waiting = %{public}d (before remove)\n", id_task, (int) waiting_tasks.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_tasks.erase(id_task);
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %{public}d from waiting list. current waiting = %{public}d (before remove)\n", id_task, (int) waiting_tasks.size());
+            waiting_tasks.erase(id_task);
+        }
+    }
+
+    // number of tasks whose results are still expected
+    size_t n_waiting() {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        return waiting_tasks.size();
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    // all the id_tasks must have been registered together with add_waiting_tasks()
+    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+
+        std::unique_lock<std::mutex> lock(channel->mutex_results);
+        channel->condition_results.wait(lock, [&]{
+            return !channel->queue_results.empty();
+        });
+
+        server_task_result_ptr res = std::move(channel->queue_results.front());
+        channel->queue_results.pop_front();
+        return res;
+    }
+
+    // same as recv(), but returns nullptr if there is no response within timeout_ms
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int64_t timeout_ms) {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+
+        std::unique_lock<std::mutex> lock(channel->mutex_results);
+        const bool ready = channel->condition_results.wait_for(lock, std::chrono::milliseconds(std::max<int64_t>(0, timeout_ms)), [&]{
+            return !channel->queue_results.empty();
+        });
+
+        if (!ready) {
+            return nullptr;
+        }
+
+        server_task_result_ptr res = std::move(channel->queue_results.front());
+        channel->queue_results.pop_front();
+        return res;
     }
 
     // single-task version of recv()
@@ -1606,20 +2673,43 @@ struct server_response {
         return recv(id_tasks);
     }
 
+    server_response_channel_ptr get_channel(const std::unordered_set<int> & id_tasks) {
+        server_response_channel_ptr channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            for (const auto & id_task : id_tasks) {
+                const auto it = waiting_tasks.find(id_task);
+                if (it != waiting_tasks.end()) {
+                    channel = it->second;
+                    break;
+                }
+            }
+        }
+
+        GGML_ASSERT(channel != nullptr && "recv() called for tasks that are not waiting");
+
+        return channel;
+    }
+
     // Send a new result to a waiting id_task
     void send(server_task_result_ptr && result) {
         SRV_DBG("sending result for task id = %{public}d\n", result->id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %{public}d pushed to result queue\n", result->id);
-
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
+        server_response_channel_ptr channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            const auto it = waiting_tasks.find(result->id);
+            if (it == waiting_tasks.end()) {
                 return;
             }
+            channel = it->second;
         }
+
+        SRV_DBG("task id = %{public}d pushed to result queue\n", result->id);
+
+        std::unique_lock<std::mutex> lock(channel->mutex_results);
+        channel->queue_results.emplace_back(std::move(result));
+        channel->condition_results.notify_one();
     }
 };
 
@@ -1635,7 +2725,14 @@ struct server_context {
 
     llama_model * model_dft = nullptr;
 
-    llama_context_params cparams_dft;
+    // shared by the speculators of all slots, one sequence per slot
+    llama_context * ctx_dft = nullptr;
+
+    // the pieces of the tokens of the vocabulary, indexed by special
+    token_piece_table token_pieces[2] = { { false, false }, { true, false } };
+
+    // the text of each token detokenized alone, as reported with n_probs, indexed by special
+    token_piece_table token_texts[2] = { { false, true }, { true, true } };
 
     llama_batch batch = {};
 
@@ -1657,19 +2754,89 @@ struct server_context {
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // prompt prefixes in the KV cache that can be shared between slots
+    server_prefix_cache prefix_cache;
+    bool use_prefix_cache = false;
+
+    // runs the samplers of the slots in parallel after each decode
+    std::unique_ptr<parallel_pool> sampling_pool;
+
+    // states of the slots evicted by LRU, see --slot-cache-path
+    server_disk_cache disk_cache;
+    bool use_disk_cache = false;
+
+    // n-gram statistics shared by the slots for speculative.ngram, see --lookup-cache-static and --lookup-cache-dynamic
+    common_ngram_cache ngram_cache_static;  // statistics of a text corpus, read-only
+    common_ngram_cache ngram_cache_dynamic; // statistics of the previous generations, saved to disk when the server is idle
+    bool    ngram_cache_dirty   = false;
+    int64_t t_ngram_cache_saved = 0;
+
+    // the dynamic cache is no longer fed beyond this number of n-grams
+    static constexpr size_t n_ngram_cache_max = 256*1024;
+
+    // the dynamic cache is written at most once per interval, and on exit
+    static constexpr int64_t t_ngram_cache_save_us = 60ll*1000*1000;
+
+    // first slot considered when batching the pending prompts, rotated on each iteration
+    size_t i_slot_prefill = 0;
+
+    // the kind of work in the current batch, see update_slots()
+    bool batch_non_causal = false;
+
+    // tokens of the batch that are decoded with the same LoRA adapters
+    struct server_batch_group {
+        std::vector<common_lora_adapter_info> * lora;
+
+        int32_t i_begin;
+        int32_t i_end;
+    };
+
+    // the adapter set that is decoded first, rotated on each iteration so that no set is always served last
+    size_t i_lora_group = 0;
+
+    // a speculative draft of a slot, waiting to be verified by the target model
+    struct server_draft {
+        server_slot * slot;
+
+        llama_token  id; // the sampled token that the draft follows
+        llama_tokens draft;
+
+        // the parent of each draft token for a draft tree, empty for a chain
+        std::vector<int> parents;
+
+        std::vector<int> idxs; // positions of id and of the draft tokens in the batch
+
+        double t_draft; // ms
+        bool   batched;
+    };
+
+    // requests preempted by higher priority tasks, together with the state of their sequence
+    // ordered by priority, FIFO for the same priority
+    struct server_slot_preempted {
+        server_slot_request request;
+
+        // the KV cache of the sequence and its tokens
+        std::vector<uint8_t> state;
+        llama_tokens         cache_tokens;
+    };
+
+    std::deque<server_slot_preempted> slots_preempted;
+
     ~server_context() {
+        save_ngram_cache(true);
+
+        for (auto & preempted : slots_preempted) {
+            common_sampler_free(preempted.request.smpl);
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             common_sampler_free(slot.smpl);
             slot.smpl = nullptr;
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
-
             common_speculative_free(slot.spec);
             slot.spec = nullptr;
 
-            llama_batch_free(slot.batch_spec);
         }
 
         llama_batch_free(batch);
@@ -1680,7 +2847,17 @@ struct server_context {
 
         params_base = params;
 
-        llama_init = common_init_from_params(params_base);
+        {
+            auto params_tgt = params_base;
+
+            // the leaves of the draft trees are verified in sequences of their own, after the sequences of the slots,
+            // see draft_tree_seq_id()
+            if (!params_base.speculative.model.empty() && params_base.speculative.n_tree > 0) {
+                params_tgt.n_parallel = params_base.n_parallel*(1 + params_base.speculative.n_tree);
+            }
+
+            llama_init = common_init_from_params(params_tgt);
+        }
 
         model = llama_init.model.get();
         ctx   = llama_init.context.get();
@@ -1700,35 +2877,40 @@ struct server_context {
 
             auto params_dft = params_base;
 
+            // a single draft context for all slots, each slot drafts in the sequence of its id
+            const int n_ctx_dft = params_base.speculative.n_ctx == 0 ? n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+
             params_dft.devices      = params_base.speculative.devices;
             params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_ctx        = n_ctx_dft * params_base.n_parallel;
+            params_dft.n_batch      = n_ctx_dft;
             params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+            params_dft.n_parallel   = params_base.n_parallel;
+
+            // force F16 KV cache for the draft model for extra performance
+            params_dft.cache_type_k = GGML_TYPE_F16;
+            params_dft.cache_type_v = GGML_TYPE_F16;
 
             llama_init_dft = common_init_from_params(params_dft);
 
             model_dft = llama_init_dft.model.get();
+            ctx_dft   = llama_init_dft.context.get();
 
             if (model_dft == nullptr) {
                 SRV_ERR("failed to load draft model, '%{public}s'\n", params_base.speculative.model.c_str());
                 return false;
             }
 
-            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
-                SRV_ERR("the draft model '%{public}s' is not compatible with the target model '%{public}s'\n", params_base.speculative.model.c_str(), params_base.model.c_str());
-
+            if (ctx_dft == nullptr) {
+                SRV_ERR("failed to create draft context, '%{public}s'\n", params_base.speculative.model.c_str());
                 return false;
             }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
-
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+            if (!common_speculative_are_compatible(ctx, ctx_dft)) {
+                SRV_ERR("the draft model '%{public}s' is not compatible with the target model '%{public}s'\n", params_base.speculative.model.c_str(), params_base.model.c_str());
 
-            // force F16 KV cache for the draft model for extra performance
-            cparams_dft.type_k = GGML_TYPE_F16;
-            cparams_dft.type_v = GGML_TYPE_F16;
+                return false;
+            }
         }
 
         return true;
@@ -1743,6 +2925,12 @@ struct server_context {
     void init() {
         const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
 
+        // the candidates of a draft tree are verified in sequences of their own, which recurrent models do not support
+        if (params_base.speculative.n_tree > 0 && (model_dft == nullptr || llama_model_is_recurrent(model))) {
+            SRV_WRN("%{public}s", "draft trees need a draft model and a non-recurrent model, --draft-tree is ignored\n");
+            params_base.speculative.n_tree = 0;
+        }
+
         SRV_INF("initializing slots, n_slots = %{public}d\n", params_base.n_parallel);
 
         for (int i = 0; i < params_base.n_parallel; i++) {
@@ -1754,15 +2942,10 @@ struct server_context {
             slot.n_predict = params_base.n_predict;
 
             if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
-
-                slot.ctx_dft = llama_new_context_with_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr) {
-                    SRV_ERR("%{public}s", "failed to create draft context\n");
-                    return;
-                }
+                slot.ctx_dft = ctx_dft;
 
-                slot.spec = common_speculative_init(slot.ctx_dft);
+                // the slots share the draft KV cache, and the cached prefixes of each other
+                slot.spec = common_speculative_init(ctx_dft, slot.id, slots.empty() ? nullptr : slots[0].spec);
                 if (slot.spec == nullptr) {
                     SRV_ERR("%{public}s", "failed to create speculator\n");
                     return;
@@ -1784,13 +2967,49 @@ struct server_context {
 
         default_generation_settings_for_props = slots[0].to_json();
 
+        // sharing KV cells between sequences is only possible with a regular (non-recurrent) KV cache
+        use_prefix_cache = params_base.n_parallel > 1 && !llama_model_is_recurrent(model);
+
+        // the decode threads are idle while the slots sample their tokens
+        sampling_pool = std::make_unique<parallel_pool>(std::max(1, std::min(params_base.cpuparams.n_threads, params_base.n_parallel)));
+
+        if (!params_base.slot_cache_path.empty()) {
+            char desc[128];
+            llama_model_desc(model, desc, sizeof(desc));
+
+            // the stored states are only valid for the same model, slot context size and KV cache types
+            const std::string fingerprint = string_format("%s|%" PRIu64 "|%d|%s|%s", desc, llama_model_n_params(model), slots[0].n_ctx,
+                    ggml_type_name(params_base.cache_type_k), ggml_type_name(params_base.cache_type_v));
+
+            use_disk_cache = disk_cache.init(params_base.slot_cache_path, (size_t) params_base.slot_cache_size*1024*1024, fingerprint);
+            if (!use_disk_cache) {
+                SRV_WRN("failed to create the slot cache directory '%{public}s', the slot cache is disabled\n", params_base.slot_cache_path.c_str());
+            }
+        }
+
+        load_ngram_cache();
+
+        // built before the server accepts requests, so that neither the main loop nor the HTTP threads pay for it
+        {
+            const int64_t t_start = ggml_time_us();
+
+            for (auto & table : token_pieces) {
+                table.build(ctx);
+            }
+            for (auto & table : token_texts) {
+                table.build(ctx);
+            }
+
+            SRV_INF("built the token tables in %.2f ms\n", (ggml_time_us() - t_start) / 1000.0);
+        }
+
         // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
         // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
         {
             const int32_t n_batch = llama_n_batch(ctx);
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+            // only a single seq_id per token is needed, except for the tokens of draft trees
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1 + params_base.speculative.n_tree);
         }
 
         metrics.init();
@@ -1825,8 +3044,11 @@ struct server_context {
                     continue;
                 }
 
+                // usually a no-op, the index is kept up to date in update_slots()
+                slot.update_cache_index();
+
                 // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+                int cur_lcs_len = slot.cache_index.lcs(task.prompt_tokens);
 
                 // fraction of the common subsequence length compared to the current slot's prompt length
                 float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
@@ -1844,28 +3066,94 @@ struct server_context {
             }
         }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = ggml_time_us();
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = ggml_time_us();
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last) {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    static std::vector<float> lora_scales(const std::vector<common_lora_adapter_info> & lora) {
+        std::vector<float> scales;
+        for (const auto & la : lora) {
+            scales.push_back(la.scale);
+        }
+        return scales;
+    }
+
+    // write the KV state of an idle slot to the disk cache
+    // the state is copied out of the context here, the file is written in the background
+    void spill_slot(server_slot & slot) {
+        if (slot.cache_tokens.size() < server_disk_cache::n_tokens_min) {
+            return;
+        }
+
+        const auto lora = lora_scales(slot.lora);
+        if (disk_cache.contains(slot.cache_tokens, lora)) {
+            return;
+        }
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id));
+        const size_t n_state = llama_state_seq_get_data(ctx, state.data(), state.size(), slot.id);
+        if (n_state == 0) {
+            return;
+        }
+        state.resize(n_state);
+
+        SLT_INF(slot, "spilling %zu tokens to the slot cache, %zu bytes\n", slot.cache_tokens.size(), n_state);
+
+        disk_cache.store(slot.cache_tokens, lora, std::move(state));
+    }
+
+    // the prompt of the slot waits for its state to be read from the disk cache
+    static bool is_reading_state(const server_slot & slot) {
+        return slot.state == SLOT_STATE_STARTED && slot.disk_read && !slot.disk_read->done;
+    }
+
+    // load the state read from the disk cache for the prompt, it shares a longer prefix with the prompt than the tokens
+    // cached in the slot
+    void restore_slot(server_slot & slot) {
+        const std::shared_ptr<server_disk_cache_read> rd = std::move(slot.disk_read);
+        if (!rd || !rd->ok) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        prefix_cache.remove(slot.id);
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
-            }
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
-            }
+        slot.cache_tokens.clear();
+        slot.cache_index.clear();
+        slot.n_kv_shared = 0;
+
+        if (llama_state_seq_set_data(ctx, rd->state.data(), rd->state.size(), slot.id) == 0) {
+            SLT_WRN(slot, "%{public}s", "failed to restore the state from the slot cache\n");
+            llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+            return;
         }
 
-        return ret;
+        slot.cache_tokens = std::move(rd->tokens);
+
+        SLT_INF(slot, "restored %zu tokens from the slot cache in %.2f ms\n", slot.cache_tokens.size(), (ggml_time_us() - t_start) / 1000.0);
     }
 
     bool launch_slot_with_task(server_slot & slot, const server_task & task) {
@@ -1873,13 +3161,18 @@ struct server_context {
         slot.id_task       = task.id;
         slot.index         = task.index;
         slot.task_type     = task.type;
+        slot.t_queued      = task.t_queued;
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
 
         if (!are_lora_equal(task.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
             slot.cache_tokens.clear();
+            slot.cache_index.clear();
             slot.lora = task.params.lora;
+
+            // nor can other slots
+            prefix_cache.remove(slot.id);
         }
 
         SLT_DBG(slot, "launching slot : %{public}s\n", safe_json_to_str(slot.to_json()).c_str());
@@ -1907,10 +3200,14 @@ struct server_context {
             }
         }
 
-        if (slot.ctx_dft) {
-            llama_batch_free(slot.batch_spec);
+        slot.stop_matcher.init(slot.params.antiprompt);
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        // a stored state may hold a longer prefix of the prompt than the slot, it is read in the background and the
+        // prompt is processed once it is available, see restore_slot()
+        if (use_disk_cache && slot.params.cache_prompt && !slot.is_non_causal()) {
+            const size_t n_min = std::max(server_disk_cache::n_tokens_min, common_lcp(slot.cache_tokens, slot.prompt_tokens) + 1);
+
+            slot.disk_read = disk_cache.prefetch(slot.prompt_tokens, lora_scales(slot.lora), n_min);
         }
 
         slot.state = SLOT_STATE_STARTED;
@@ -1926,48 +3223,191 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        prefix_cache.clear();
+        for (server_slot & slot : slots) {
+            slot.n_kv_shared = 0;
+        }
+    }
+
+    // find a generating slot with a lower priority than the task, that can be preempted to make room for it
+    server_slot * get_preemptible_slot(const server_task & task) {
+        if (slots_preempted.size() >= slots.size()) {
+            return nullptr;
+        }
+
+        server_slot * ret = nullptr;
+
+        for (server_slot & slot : slots) {
+            if (task.id_selected_slot != -1 && slot.id != task.id_selected_slot) {
+                continue;
+            }
+
+            if (slot.state != SLOT_STATE_GENERATING || slot.is_non_causal() || slot.params.priority >= task.params.priority) {
+                continue;
+            }
+
+            // lowest priority first, then the slot with the smallest state to save
+            if (ret == nullptr || slot.params.priority < ret->params.priority ||
+                (slot.params.priority == ret->params.priority && slot.n_past < ret->n_past)) {
+                ret = &slot;
+            }
+        }
+
+        return ret;
+    }
+
+    // save the request of a generating slot and the KV cache of its sequence, the slot is left idle
+    bool preempt_slot(server_slot & slot) {
+        server_slot_preempted preempted;
+
+        const size_t n_state = llama_state_seq_get_size(ctx, slot.id);
+        preempted.state.resize(n_state);
+        if (llama_state_seq_get_data(ctx, preempted.state.data(), n_state, slot.id) != n_state) {
+            SLT_WRN(slot, "%{public}s", "failed to save the state of the sequence, cannot preempt\n");
+            return false;
+        }
+
+        SLT_INF(slot, "preempting task, priority = %{public}d, n_past = %{public}d, state size = %zu\n", slot.params.priority, slot.n_past, n_state);
+
+        preempted.request      = std::move(static_cast<server_slot_request &>(slot));
+        preempted.cache_tokens = std::move(slot.cache_tokens);
+
+        // the sampler now belongs to the preempted request
+        slot.smpl = nullptr;
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        prefix_cache.remove(slot.id);
+
+        slot.cache_tokens.clear();
+        slot.cache_index.clear();
+        slot.n_kv_shared = 0;
+
+        // the request is not finished, so the slot is not released
+        slot.id_task = -1;
+        slot.state   = SLOT_STATE_IDLE;
+
+        const auto it = std::find_if(slots_preempted.begin(), slots_preempted.end(), [&](const server_slot_preempted & p) {
+            return p.request.params.priority < preempted.request.params.priority;
+        });
+        slots_preempted.insert(it, std::move(preempted));
+
+        metrics.n_preempted_total++;
+
+        return true;
+    }
+
+    // number of preempted requests that must be resumed before a task with the given priority can start
+    int n_preempted_before(int priority) const {
+        int n = 0;
+        for (const auto & preempted : slots_preempted) {
+            n += preempted.request.params.priority >= priority;
+        }
+        return n;
+    }
+
+    // restore the preempted requests into the idle slots, highest priority first
+    void resume_preempted_slots() {
+        if (slots_preempted.empty()) {
+            return;
+        }
+
+        while (!slots_preempted.empty()) {
+            server_slot * slot = nullptr;
+            for (server_slot & cur : slots) {
+                if (!cur.is_processing()) {
+                    slot = &cur;
+                    break;
+                }
+            }
+
+            if (slot == nullptr) {
+                break;
+            }
+
+            server_slot_preempted preempted = std::move(slots_preempted.front());
+            slots_preempted.pop_front();
+
+            llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+            prefix_cache.remove(slot->id);
+
+            if (llama_state_seq_set_data(ctx, preempted.state.data(), preempted.state.size(), slot->id) == 0) {
+                SLT_ERR(*slot, "failed to restore preempted task %{public}d\n", preempted.request.id_task);
+
+                slot->cache_tokens.clear();
+                slot->cache_index.clear();
+                slot->n_kv_shared = 0;
+
+                send_error(preempted.request.id_task, "failed to resume the request after it was preempted", ERROR_TYPE_SERVER);
+                common_sampler_free(preempted.request.smpl);
+                continue;
+            }
+
+            // take over the request, the resources of the slot are kept
+            common_sampler_free(slot->smpl);
+
+            static_cast<server_slot_request &>(*slot) = std::move(preempted.request);
+
+            // the indexes of the previous cache_tokens of the slot are rebuilt from the restored ones
+            slot->cache_tokens = std::move(preempted.cache_tokens);
+            slot->cache_index.clear();
+            slot->update_cache_index();
+            slot->ngram_cache.clear();
+            slot->n_ngram_cache = 0;
+            slot->n_kv_shared   = 0;
+
+            SLT_INF(*slot, "resumed preempted task, priority = %{public}d, n_past = %{public}d\n", slot->params.priority, slot->n_past);
+        }
+
+        // the tasks deferred in favor of the preempted requests can use the remaining idle slots
+        for (const server_slot & slot : slots) {
+            if (!slot.is_processing()) {
+                queue_tasks.pop_deferred_task();
+            }
+        }
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = result.text_to_send;
         slot.sampled = result.tok;
 
-        slot.generated_text += token_str;
+        slot.generated_text += result.text_to_send;
         if (slot.params.return_tokens) {
             slot.generated_tokens.push_back(result.tok);
         }
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
+        // check if there is incomplete UTF-8 character at the end, only the new bytes are scanned
+        slot.n_text_valid = validate_utf8(slot.generated_text, slot.n_text_valid);
+
+        bool incomplete = slot.n_text_valid < slot.generated_text.size();
 
         // search stop word and delete it
         if (!incomplete) {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
 
-            const std::string str_test = slot.generated_text.substr(pos);
             bool send_text = true;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
+            size_t stop_pos = slot.find_stopping_strings(pos, true);
             if (stop_pos != std::string::npos) {
                 slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.begin() + stop_pos,
                     slot.generated_text.end());
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
+                stop_pos = slot.find_stopping_strings(pos, false);
                 send_text = stop_pos == std::string::npos;
             }
 
             // check if there is any token to predict
             if (send_text) {
                 // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                // the unsent text is copied once, into the buffer of the token piece
+                result.text_to_send.assign(std::string_view(slot.generated_text).substr(pos));
                 slot.n_sent_text += result.text_to_send.size();
                 // add the token to slot queue and cache
             } else {
-                result.text_to_send = "";
+                result.text_to_send.clear();
             }
 
             slot.add_token(result);
@@ -2021,13 +3461,15 @@ struct server_context {
                     }
                 }
 
-                // find the next new line
+                // find the next new line, in the text that was not searched yet
                 {
-                    const size_t pos = slot.generated_text.find('\n', slot.last_nl_pos);
+                    const size_t pos = slot.generated_text.find('\n', std::max(slot.last_nl_pos, slot.n_nl_searched));
 
                     if (pos != std::string::npos) {
                         slot.last_nl_pos = pos + 1;
                     }
+
+                    slot.n_nl_searched = pos != std::string::npos ? pos + 1 : slot.generated_text.size();
                 }
             }
         }
@@ -2067,12 +3509,12 @@ struct server_context {
                     slot.params.n_predict, n_ctx_train);
         }
 
-        SLT_DBG(slot, "n_decoded = %{public}d, n_remaining = %{public}d, next token: %5d '%{public}s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
+        SLT_DBG(slot, "n_decoded = %{public}d, n_remaining = %{public}d, next token: %5d, sent: '%{public}s'\n", slot.n_decoded, slot.n_remaining, result.tok, result.text_to_send.c_str());
 
         return slot.has_next_token; // continue
     }
 
-    void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
+    void populate_token_probs(server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
         size_t n_probs = slot.params.sampling.n_probs;
         size_t n_vocab = llama_n_vocab(llama_get_model(ctx));
         if (post_sampling) {
@@ -2092,29 +3534,22 @@ struct server_context {
             for (size_t i = 0; i < std::min(max_probs, n_probs); i++) {
                 result.probs.push_back({
                     cur_p->data[i].id,
-                    common_detokenize(ctx, {cur_p->data[i].id}, special),
+                    std::string(token_texts[special].get(cur_p->data[i].id)),
                     cur_p->data[i].p
                 });
             }
         } else {
-            // TODO: optimize this with min-p optimization
-            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
+            auto & cur = slot.probs_scratch;
 
-            // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++) {
-                // set probability for sampled token
-                if (cur[i].id == result.tok) {
-                    result.prob = cur[i].p;
-                    break;
-                }
-            }
+            // set probability for sampled token, and for top n_probs tokens in cur
+            result.prob = get_token_probabilities(llama_get_logits_ith(ctx, idx), n_vocab, result.tok, n_probs, cur);
 
             // set probability for top n_probs tokens
-            result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
+            result.probs.reserve(cur.size());
+            for (size_t i = 0; i < cur.size(); i++) {
                 result.probs.push_back({
                     cur[i].id,
-                    common_detokenize(ctx, {cur[i].id}, special),
+                    std::string(token_texts[special].get(cur[i].id)),
                     cur[i].p
                 });
             }
@@ -2158,8 +3593,8 @@ struct server_context {
         res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
 
         // populate res.probs_output
-        if (slot.params.sampling.n_probs > 0) {
-            res->prob_output = tkn; // copy the token probs
+        if (slot.params.sampling.n_probs > 0 && !tkn.probs.empty()) {
+            res->probs_output.push_back(tkn); // copy the token probs
         }
 
         // populate timings if this is final response or timings_per_token is enabled
@@ -2171,6 +3606,8 @@ struct server_context {
     }
 
     void send_final_response(server_slot & slot) {
+        merge_ngram_cache(slot);
+
         auto res = std::make_unique<server_task_result_cmpl_final>();
         res->id              = slot.id_task;
         res->id_slot         = slot.id;
@@ -2307,8 +3744,8 @@ struct server_context {
             cancel_tasks.push_back(task);
             queue_results.remove_waiting_task_id(id_task);
         }
-        // push to beginning of the queue, so it has highest priority
-        queue_tasks.post(cancel_tasks, true);
+        // the queue is FIFO, the cancel is handled in the next drain of the queue, before the slots are updated
+        queue_tasks.post(cancel_tasks);
     }
 
     // receive the results from task(s)
@@ -2339,16 +3776,48 @@ struct server_context {
     }
 
     // receive the results from task(s), in stream mode
+    // consecutive partial results of a task are coalesced into one, up to flush_ms after the first one or min_tokens
+    // tokens (0 = no limit), they are handled one by one when both limits are 0
     void receive_cmpl_results_stream(
             const std::unordered_set<int> & id_tasks,
             const std::function<bool(server_task_result_ptr&)> & result_handler,
-            const std::function<void(json)> & error_handler) {
+            const std::function<void(json)> & error_handler,
+            int32_t flush_ms = 0,
+            int32_t min_tokens = 0) {
+        const bool coalesce = flush_ms > 0 || min_tokens > 1;
+
+        // the coalesced partial result that has not been handled yet
+        server_task_result_ptr pending;
+        int64_t t_pending = 0;
+
+        const auto flush = [&]() {
+            if (!pending) {
+                return true;
+            }
+            server_task_result_ptr result = std::move(pending);
+            return result_handler(result);
+        };
+
         size_t n_finished = 0;
         while (true) {
-            server_task_result_ptr result = queue_results.recv(id_tasks);
+            server_task_result_ptr result;
+            if (pending && flush_ms > 0) {
+                result = queue_results.recv_with_timeout(id_tasks, flush_ms - (ggml_time_us() - t_pending) / 1000);
+                if (!result) {
+                    if (!flush()) {
+                        cancel_tasks(id_tasks);
+                        break;
+                    }
+                    continue;
+                }
+            } else {
+                result = queue_results.recv(id_tasks);
+            }
 
             if (result->is_error()) {
-                error_handler(result->to_json());
+                if (flush()) {
+                    error_handler(result->to_json());
+                }
                 cancel_tasks(id_tasks);
                 return;
             }
@@ -2357,7 +3826,37 @@ struct server_context {
                 dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
                 || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
             );
-            if (!result_handler(result)) {
+
+            if (coalesce && !result->is_stop()) {
+                auto * partial = static_cast<server_task_result_cmpl_partial *>(result.get());
+                auto * merged  = static_cast<server_task_result_cmpl_partial *>(pending.get());
+
+                if (merged && merged->can_merge(*partial)) {
+                    merged->merge(std::move(*partial));
+                } else {
+                    if (!flush()) {
+                        cancel_tasks(id_tasks);
+                        break;
+                    }
+                    pending   = std::move(result);
+                    merged    = partial;
+                    t_pending = ggml_time_us();
+                }
+
+                const bool full    = min_tokens > 0 && (int32_t) merged->tokens.size() >= min_tokens;
+                const bool expired = flush_ms   > 0 && (ggml_time_us() - t_pending) / 1000 >= flush_ms;
+
+                // the first result of a chat completion is not merged with the next ones, no need to hold it back
+                if (full || expired || merged->n_decoded == 0) {
+                    if (!flush()) {
+                        cancel_tasks(id_tasks);
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            if (!flush() || !result_handler(result)) {
                 cancel_tasks(id_tasks);
                 break;
             }
@@ -2385,6 +3884,28 @@ struct server_context {
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (slot != nullptr && !slot->is_processing() && !slots_preempted.empty()) {
+                        // the preempted requests with the same or a higher priority get the idle slots first
+                        int n_idle = 0;
+                        for (const server_slot & cur : slots) {
+                            n_idle += !cur.is_processing();
+                        }
+
+                        if (n_preempted_before(task.params.priority) >= n_idle) {
+                            SRV_DBG("preempted tasks are waiting, defer task, id_task = %{public}d\n", task.id);
+                            queue_tasks.defer(task);
+                            break;
+                        }
+                    }
+
+                    if (slot == nullptr || slot->is_processing()) {
+                        // make room for a higher priority task
+                        server_slot * slot_low = get_preemptible_slot(task);
+                        if (slot_low != nullptr && preempt_slot(*slot_low)) {
+                            slot = slot_low;
+                        }
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %{public}d\n", task.id);
@@ -2398,6 +3919,11 @@ struct server_context {
                         break;
                     }
 
+                    // the cached tokens that the new task does not share are about to be discarded
+                    if (use_disk_cache && common_lcp(slot->cache_tokens, task.prompt_tokens) < slot->cache_tokens.size()) {
+                        spill_slot(*slot);
+                    }
+
                     if (!launch_slot_with_task(*slot, task)) {
                         SRV_ERR("failed to launch slot with task, id_task = %{public}d\n", task.id);
                         break;
@@ -2412,10 +3938,17 @@ struct server_context {
                             break;
                         }
                     }
-                } break;
-            case SERVER_TASK_TYPE_NEXT_RESPONSE:
-                {
-                    // do nothing
+
+                    // or drop the task if it is still waiting
+                    queue_tasks.remove_deferred_task(task.id_target);
+
+                    for (auto it = slots_preempted.begin(); it != slots_preempted.end(); ++it) {
+                        if (it->request.id_task == task.id_target) {
+                            common_sampler_free(it->request.smpl);
+                            slots_preempted.erase(it);
+                            break;
+                        }
+                    }
                 } break;
             case SERVER_TASK_TYPE_METRICS:
                 {
@@ -2460,6 +3993,18 @@ struct server_context {
 
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
+                    res->n_preempted_total       = metrics.n_preempted_total;
+
+                    res->n_queued_cmpl_total = metrics.n_queued_cmpl_total;
+                    res->t_queued_cmpl_total = metrics.t_queued_cmpl_total;
+                    res->n_queued_embd_total = metrics.n_queued_embd_total;
+                    res->t_queued_embd_total = metrics.t_queued_embd_total;
+
+                    res->n_draft_total          = metrics.n_draft_total;
+                    res->n_draft_accepted_total = metrics.n_draft_accepted_total;
+                    res->n_draft_steps_total    = metrics.n_draft_steps_total;
+                    res->t_draft_spec_total     = metrics.t_draft_spec_total;
+                    res->t_draft_base_total     = metrics.t_draft_base_total;
 
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
@@ -2522,7 +4067,11 @@ struct server_context {
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
+                    prefix_cache.remove(slot->id);
+                    slot->n_kv_shared = 0;
+
                     slot->cache_tokens.resize(slot->n_ctx);
+                    slot->cache_index.clear();
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
                     if (nread == 0) {
@@ -2532,6 +4081,10 @@ struct server_context {
                     }
                     slot->cache_tokens.resize(token_count);
 
+                    if (use_prefix_cache) {
+                        prefix_cache.insert(slot->id, slot->cache_tokens, token_count);
+                    }
+
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
 
@@ -2560,28 +4113,295 @@ struct server_context {
                         break;
                     }
 
-                    // Erase token cache
-                    const size_t n_erased = slot->cache_tokens.size();
-                    llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
-                    slot->cache_tokens.clear();
+                    // Erase token cache
+                    const size_t n_erased = slot->cache_tokens.size();
+                    llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+                    slot->cache_tokens.clear();
+                    slot->cache_index.clear();
+
+                    prefix_cache.remove(slot->id);
+                    slot->n_kv_shared = 0;
+
+                    auto res = std::make_unique<server_task_result_slot_erase>();
+                    res->id       = task.id;
+                    res->id_slot  = id_slot;
+                    res->n_erased = n_erased;
+                    queue_results.send(std::move(res));
+                } break;
+            case SERVER_TASK_TYPE_SET_LORA:
+                {
+                    params_base.lora_adapters = std::move(task.set_lora);
+                    auto res = std::make_unique<server_task_result_apply_lora>();
+                    res->id = task.id;
+                    queue_results.send(std::move(res));
+                } break;
+        }
+    }
+
+    // draft the tokens that follow id from the n-gram statistics of the prompt and of the generated tokens
+    // (prompt lookup decoding), no draft model is needed
+    llama_tokens gen_draft_ngram(server_slot & slot, llama_token id, int n_draft) {
+        auto & inp = slot.cache_tokens;
+
+        update_ngram_cache(slot);
+
+        // the draft starts with the sampled token, which must also be the last token of the input
+        llama_tokens draft = { id };
+
+        inp.push_back(id);
+        common_ngram_cache_draft(inp, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+        inp.pop_back();
+
+        draft.erase(draft.begin());
+
+        return draft;
+    }
+
+    // index the tokens added to the slot since the last update
+    void update_ngram_cache(server_slot & slot) {
+        auto & inp = slot.cache_tokens;
+
+        if (slot.n_ngram_cache > inp.size()) {
+            slot.ngram_cache.clear();
+            slot.n_ngram_cache = 0;
+        }
+
+        common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, inp.size() - slot.n_ngram_cache, false);
+        slot.n_ngram_cache = inp.size();
+    }
+
+    void load_ngram_cache() {
+        if (!params_base.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = common_ngram_cache_load(params_base.lookup_cache_static);
+                SRV_INF("loaded the static n-gram cache '%{public}s', %zu n-grams\n", params_base.lookup_cache_static.c_str(), ngram_cache_static.size());
+            } catch (const std::ifstream::failure &) {
+                SRV_WRN("failed to open the static n-gram cache '%{public}s'\n", params_base.lookup_cache_static.c_str());
+            }
+        }
+
+        // the dynamic cache is created on the first save
+        if (!params_base.lookup_cache_dynamic.empty() && std::filesystem::exists(params_base.lookup_cache_dynamic)) {
+            try {
+                ngram_cache_dynamic = common_ngram_cache_load(params_base.lookup_cache_dynamic);
+                SRV_INF("loaded the dynamic n-gram cache '%{public}s', %zu n-grams\n", params_base.lookup_cache_dynamic.c_str(), ngram_cache_dynamic.size());
+            } catch (const std::ifstream::failure &) {
+                SRV_WRN("failed to open the dynamic n-gram cache '%{public}s'\n", params_base.lookup_cache_dynamic.c_str());
+            }
+        }
+    }
+
+    // merge the n-grams of a finished generation into the dynamic cache
+    void merge_ngram_cache(server_slot & slot) {
+        if (params_base.lookup_cache_dynamic.empty() || slot.n_decoded == 0) {
+            return;
+        }
+
+        if (ngram_cache_dynamic.size() >= n_ngram_cache_max) {
+            SLT_DBG(slot, "the dynamic n-gram cache is full, %zu n-grams\n", ngram_cache_dynamic.size());
+            return;
+        }
+
+        update_ngram_cache(slot);
+        common_ngram_cache_merge(ngram_cache_dynamic, slot.ngram_cache);
+        ngram_cache_dirty = true;
+    }
+
+    // write the dynamic cache through a temporary file, so that an interrupted save does not leave a truncated cache
+    void save_ngram_cache(bool force) {
+        if (!ngram_cache_dirty) {
+            return;
+        }
+
+        const int64_t t_now = ggml_time_us();
+        if (!force && t_ngram_cache_saved > 0 && t_now - t_ngram_cache_saved < t_ngram_cache_save_us) {
+            return;
+        }
+
+        std::string path_tmp = params_base.lookup_cache_dynamic + ".tmp";
+        common_ngram_cache_save(ngram_cache_dynamic, path_tmp);
+
+        std::error_code ec;
+        std::filesystem::rename(path_tmp, params_base.lookup_cache_dynamic, ec);
+        if (ec) {
+            SRV_WRN("failed to save the dynamic n-gram cache '%{public}s': %{public}s\n", params_base.lookup_cache_dynamic.c_str(), ec.message().c_str());
+            std::filesystem::remove(path_tmp, ec);
+        } else {
+            SRV_DBG("saved the dynamic n-gram cache, %zu n-grams\n", ngram_cache_dynamic.size());
+        }
+
+        ngram_cache_dirty   = false;
+        t_ngram_cache_saved = t_now;
+    }
+
+    // number of leading draft tokens that form the greedy chain, the others are the candidates (leaves) of a draft tree
+    static int n_draft_chain(const std::vector<int> & parents) {
+        int n_chain = 0;
+        while (n_chain < (int) parents.size() && parents[n_chain] == n_chain - 1) {
+            n_chain++;
+        }
+        return n_chain;
+    }
+
+    static int n_draft_tree_leaves(const server_draft & d) {
+        return d.parents.size() - n_draft_chain(d.parents);
+    }
+
+    // the sequence of the j-th leaf of the draft tree of a slot, after the sequences of the slots
+    llama_seq_id draft_tree_seq_id(const server_slot & slot, int j) const {
+        const llama_seq_id seq_id = params_base.n_parallel + slot.id*params_base.speculative.n_tree + j;
+        GGML_ASSERT(seq_id < (llama_seq_id) llama_n_seq_max(ctx));
+        return seq_id;
+    }
+
+    // add a draft tree to the batch
+    // each leaf is decoded in a sequence of its own, which sees the cells of the slot and the chain up to its parent
+    // a token of the chain is in the sequence of the slot and in the sequences of the leaves that are deeper than it
+    void add_draft_tree(server_draft & d) {
+        server_slot & slot = *d.slot;
+
+        const int n_chain = n_draft_chain(d.parents);
+        const int n_leaf  = n_draft_tree_leaves(d);
+
+        for (int j = 0; j < n_leaf; ++j) {
+            const llama_seq_id seq_id = draft_tree_seq_id(slot, j);
+
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, slot.id, seq_id, -1, slot.n_past);
+        }
+
+        // i = -1 is the sampled token
+        std::vector<llama_seq_id> seq_ids;
+        for (int i = -1; i < n_chain; ++i) {
+            seq_ids = { slot.id };
+            for (int j = 0; j < n_leaf; ++j) {
+                if (d.parents[n_chain + j] >= i) {
+                    seq_ids.push_back(draft_tree_seq_id(slot, j));
+                }
+            }
+
+            d.idxs.push_back(batch.n_tokens);
+            common_batch_add(batch, i < 0 ? d.id : d.draft[i], slot.n_past + 1 + i, seq_ids, true);
+        }
+
+        for (int j = 0; j < n_leaf; ++j) {
+            d.idxs.push_back(batch.n_tokens);
+            common_batch_add(batch, d.draft[n_chain + j], slot.n_past + 2 + d.parents[n_chain + j], { draft_tree_seq_id(slot, j) }, true);
+        }
+    }
+
+    // sample along the draft tree, and keep the cells of the accepted path in the sequence of the slot
+    std::vector<llama_token> accept_draft_tree(const server_draft & d) {
+        server_slot & slot = *d.slot;
+
+        const int n_chain = n_draft_chain(d.parents);
+        const int n_leaf  = n_draft_tree_leaves(d);
+
+        std::vector<int> path;
+        std::vector<llama_token> ids = common_sampler_sample_and_accept_tree(slot.smpl, ctx, d.idxs, d.draft, d.parents, path);
+
+        // the path ends with a leaf, which replaces the token of the chain at the same position
+        if (!path.empty() && path.back() >= n_chain) {
+            const llama_pos pos = slot.n_past + path.size();
+
+            llama_kv_cache_seq_rm(ctx, slot.id, pos, -1);
+            llama_kv_cache_seq_cp(ctx, draft_tree_seq_id(slot, path.back() - n_chain), slot.id, pos, pos + 1);
+        }
+
+        for (int j = 0; j < n_leaf; ++j) {
+            llama_kv_cache_seq_rm(ctx, draft_tree_seq_id(slot, j), -1, -1);
+        }
+
+        return ids;
+    }
+
+    // reorder the tokens of the batch so that the tokens of the slots that use the same LoRA adapters are contiguous
+    // returns the groups in the order in which they should be decoded
+    std::vector<server_batch_group> group_batch_by_lora() {
+        std::vector<server_batch_group> groups;
+        std::vector<int> slot_group(slots.size(), -1);
+
+        for (auto & slot : slots) {
+            if (!slot.is_processing() || slot.is_non_causal() != batch_non_causal) {
+                continue;
+            }
+
+            for (size_t g = 0; g < groups.size(); ++g) {
+                if (are_lora_equal(*groups[g].lora, slot.lora)) {
+                    slot_group[slot.id] = g;
+                    break;
+                }
+            }
+
+            if (slot_group[slot.id] < 0) {
+                slot_group[slot.id] = groups.size();
+                groups.push_back({ &slot.lora, 0, 0 });
+            }
+        }
+
+        if (groups.size() <= 1) {
+            // common case - the whole batch uses the same adapters
+            auto & lora = groups.empty() ? params_base.lora_adapters : *groups[0].lora;
+            return { { &lora, 0, batch.n_tokens } };
+        }
+
+        // round-robin between the groups
+        const int n_groups = groups.size();
+        const int n_rotate = i_lora_group % n_groups;
+
+        std::rotate(groups.begin(), groups.begin() + n_rotate, groups.end());
+        for (int & g : slot_group) {
+            if (g >= 0) {
+                g = (g + n_groups - n_rotate) % n_groups;
+            }
+        }
+
+        i_lora_group = (i_lora_group + 1) % n_groups;
 
-                    auto res = std::make_unique<server_task_result_slot_erase>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->n_erased = n_erased;
-                    queue_results.send(std::move(res));
-                } break;
-            case SERVER_TASK_TYPE_SET_LORA:
-                {
-                    params_base.lora_adapters = std::move(task.set_lora);
-                    auto res = std::make_unique<server_task_result_apply_lora>();
-                    res->id = task.id;
-                    queue_results.send(std::move(res));
-                } break;
+        // stable counting sort of the tokens by group
+        std::vector<int32_t> n_group(n_groups, 0);
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            n_group[slot_group[batch.seq_id[i][0]]]++;
+        }
+
+        int32_t i_begin = 0;
+        for (int g = 0; g < n_groups; ++g) {
+            groups[g].i_begin = i_begin;
+            groups[g].i_end   = i_begin;
+            i_begin += n_group[g];
+        }
+
+        std::vector<int32_t> i_new(batch.n_tokens);
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            i_new[i] = groups[slot_group[batch.seq_id[i][0]]].i_end++;
+        }
+
+        const std::vector<llama_token>    token   (batch.token,    batch.token    + batch.n_tokens);
+        const std::vector<llama_pos>      pos     (batch.pos,      batch.pos      + batch.n_tokens);
+        const std::vector<int32_t>        n_seq_id(batch.n_seq_id, batch.n_seq_id + batch.n_tokens);
+        const std::vector<llama_seq_id *> seq_id  (batch.seq_id,   batch.seq_id   + batch.n_tokens);
+        const std::vector<int8_t>         logits  (batch.logits,   batch.logits   + batch.n_tokens);
+
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            batch.token   [i_new[i]] = token[i];
+            batch.pos     [i_new[i]] = pos[i];
+            batch.n_seq_id[i_new[i]] = n_seq_id[i];
+            batch.seq_id  [i_new[i]] = seq_id[i];
+            batch.logits  [i_new[i]] = logits[i];
+        }
+
+        for (auto & slot : slots) {
+            if (slot.i_batch >= 0) {
+                slot.i_batch = i_new[slot.i_batch];
+            }
         }
+
+        return groups;
     }
 
     void update_slots() {
+        resume_preempted_slots();
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2599,17 +4419,14 @@ struct server_context {
                     kv_cache_clear();
                 }
 
+                save_ngram_cache(false);
+
                 return;
             }
         }
 
-        {
-            SRV_DBG("%{public}s", "posting NEXT_RESPONSE\n");
-
-            server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
-            task.id = queue_tasks.get_new_id();
-            queue_tasks.post(task);
-        }
+        // keep the main loop running without waiting for new tasks
+        queue_tasks.next_response();
 
         // apply context-shift if needed
         // TODO: simplify and improve
@@ -2624,12 +4441,21 @@ struct server_context {
                 }
 
                 // Shift context
-                const int n_keep    = slot.params.n_keep + add_bos_token;
+                // note: the cells shared with other slots are always kept, because they cannot be shifted
+                const int n_keep    = std::max(slot.params.n_keep + add_bos_token, slot.n_kv_shared);
                 const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                const int n_discard = std::max(1, slot.params.n_discard ? slot.params.n_discard : (n_left / 2));
+
+                if (n_left <= 0) {
+                    slot.release();
+                    send_error(slot, "cannot shift the context, the whole context is shared with other slots", ERROR_TYPE_SERVER);
+                    continue;
+                }
 
                 SLT_WRN(slot, "slot context shift, n_keep = %{public}d, n_left = %{public}d, n_discard = %{public}d\n", n_keep, n_left, n_discard);
 
+                prefix_cache.truncate(slot.id, n_keep);
+
                 llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
                 llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
 
@@ -2639,6 +4465,10 @@ struct server_context {
                     }
 
                     slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                    slot.cache_index.clear();
+
+                    slot.ngram_cache.clear();
+                    slot.n_ngram_cache = 0;
                 }
 
                 slot.n_past -= n_discard;
@@ -2653,9 +4483,26 @@ struct server_context {
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
 
+        // causal (completion) and non-causal (embedding, rerank) work cannot share a llama_decode() call
+        // when both are pending, alternate between them on each iteration so that neither of them waits for
+        // the other to finish
+        {
+            bool has_causal     = false;
+            bool has_non_causal = false;
+
+            for (const auto & slot : slots) {
+                if (slot.is_processing()) {
+                    has_causal     |= !slot.is_non_causal();
+                    has_non_causal |=  slot.is_non_causal();
+                }
+            }
+
+            batch_non_causal = has_non_causal && (!has_causal || !batch_non_causal);
+        }
+
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
-            if (slot.state != SLOT_STATE_GENERATING) {
+            if (slot.state != SLOT_STATE_GENERATING || slot.is_non_causal() != batch_non_causal) {
                 continue;
             }
 
@@ -2686,7 +4533,59 @@ struct server_context {
 
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            // when slots are generating, limit the number of prompt tokens added to their batch, so that a long prompt
+            // does not stall the generation of the other slots
+            int32_t n_prefill_left = n_batch;
+            if (params_base.n_prefill_budget > 0 && batch.n_tokens > 0) {
+                n_prefill_left = params_base.n_prefill_budget;
+            }
+
+            // start from a different slot on each iteration, so that all the prompts make progress
+            const size_t i_slot_start = (i_slot_prefill + 1) % slots.size();
+
+            // count the prompts that will be added to this batch, with the same checks as below, so that the budget is
+            // not shared with slots that are skipped; non-causal prompts are never split and do not take a share
+            bool has_prefill     = false;
+            int  n_prefill_slots = 0;
+            {
+                server_slot * slot_ref = slot_batched;
+
+                for (size_t k = 0; k < slots.size(); ++k) {
+                    auto & slot = slots[(i_slot_start + k) % slots.size()];
+
+                    if (!slot.is_processing() || slot.is_non_causal() != batch_non_causal || is_reading_state(slot)) {
+                        continue;
+                    }
+
+                    if (!slot_ref) {
+                        slot_ref = &slot;
+                    } else if (!slot_ref->can_batch_with(slot)) {
+                        continue;
+                    }
+
+                    if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
+                        has_prefill      = true;
+                        n_prefill_slots += !slot.is_non_causal();
+                    }
+                }
+            }
+
+            if (has_prefill) {
+                i_slot_prefill = i_slot_start;
+            }
+
+            for (size_t k = 0; k < slots.size(); ++k) {
+                auto & slot = slots[(i_slot_prefill + k) % slots.size()];
+
+                if (slot.is_processing() && slot.is_non_causal() != batch_non_causal) {
+                    continue;
+                }
+
+                // the prompt starts once its state has been read from the disk cache
+                if (is_reading_state(slot)) {
+                    continue;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -2700,11 +4599,24 @@ struct server_context {
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
+                    // the budget left is shared evenly by the slots that have not been visited yet
+                    int32_t n_prefill_slot = 0;
+                    if (!slot.is_non_causal()) {
+                        n_prefill_slot = (n_prefill_left + n_prefill_slots - 1) / std::max(1, n_prefill_slots);
+                        n_prefill_slots--;
+                    }
+
+                    if (n_prefill_slot <= 0 && !slot.is_non_causal()) {
+                        continue;
+                    }
+
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
+                        metrics.on_prompt_start(slot);
+
                         slot.n_past = 0;
                         slot.n_prompt_tokens = prompt_tokens.size();
                         slot.state = SLOT_STATE_PROCESSING_PROMPT;
@@ -2789,9 +4701,39 @@ struct server_context {
                             }
 
                             if (slot.params.cache_prompt) {
+                                // an evicted state may hold a longer prefix of the prompt than this slot
+                                if (use_disk_cache) {
+                                    restore_slot(slot);
+                                }
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
 
+                                // if another slot holds a longer prefix of the prompt, share its KV cells instead
+                                if (use_prefix_cache) {
+                                    const auto match = prefix_cache.find(prompt_tokens, [&](int id) {
+                                        return id != slot.id && are_lora_equal(slots[id].lora, slot.lora);
+                                    });
+
+                                    if (match.first >= 0 && (int) match.second > slot.n_past) {
+                                        server_slot & slot_src = slots[match.first];
+
+                                        SLT_INF(slot, "reusing prefix of slot %{public}d, n_past = %{public}d -> %{public}d\n", slot_src.id, slot.n_past, (int) match.second);
+
+                                        prefix_cache.remove(slot.id);
+
+                                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                                        llama_kv_cache_seq_cp(ctx, slot_src.id, slot.id, 0, match.second);
+
+                                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + match.second);
+                                        slot.cache_index.clear();
+                                        slot.n_past      = match.second;
+                                        slot.n_kv_shared = match.second;
+
+                                        slot_src.n_kv_shared = std::max(slot_src.n_kv_shared, slot.n_kv_shared);
+                                    }
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -2810,7 +4752,8 @@ struct server_context {
                                             n_match++;
                                         }
 
-                                        if (n_match >= (size_t) params_base.n_cache_reuse) {
+                                        // the shared cells cannot be shifted
+                                        if (n_match >= (size_t) params_base.n_cache_reuse && head_c >= (size_t) slot.n_kv_shared) {
                                             SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
                                             //for (size_t i = head_p; i < head_p + n_match; i++) {
                                             //    SLT_DBG(slot, "cache token %3zu: %6d '%{public}s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
@@ -2826,6 +4769,8 @@ struct server_context {
                                                 slot.n_past++;
                                             }
 
+                                            slot.cache_index.clear();
+
                                             head_c += n_match;
                                             head_p += n_match;
                                         } else {
@@ -2865,13 +4810,23 @@ struct server_context {
                         slot.n_past = 0;
                     }
 
+                    prefix_cache.truncate(slot.id, slot.n_past);
+                    slot.n_kv_shared = std::min(slot.n_kv_shared, slot.n_past);
+
                     SLT_INF(slot, "kv cache rm [%{public}d, end)\n", slot.n_past);
 
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
+                    if (slot.cache_index.size() > slot.cache_tokens.size()) {
+                        slot.cache_index.clear();
+                    }
+
+                    // non-causal prompts are never split, see above
+                    const int32_t n_prefill_end = slot.is_non_causal() ? n_batch : std::min(n_batch, batch.n_tokens + n_prefill_slot);
+                    const int32_t n_prefill_beg = batch.n_tokens;
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_prefill_end) {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
@@ -2885,6 +4840,8 @@ struct server_context {
                         slot.n_past++;
                     }
 
+                    n_prefill_left = std::max(0, n_prefill_left - (batch.n_tokens - n_prefill_beg));
+
                     SLT_INF(slot, "prompt processing progress, n_past = %{public}d, n_tokens = %{public}d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
 
                     // entire prompt has been processed
@@ -2916,7 +4873,20 @@ struct server_context {
             }
         }
 
+        // index the tokens appended to the slot caches in this iteration
+        for (auto & slot : slots) {
+            slot.update_cache_index();
+        }
+
         if (batch.n_tokens == 0) {
+            // nothing else to decode while the prompts wait for the disk cache, wait for it instead of spinning
+            for (const auto & slot : slots) {
+                if (is_reading_state(slot)) {
+                    disk_cache.wait(*slot.disk_read, 10);
+                    return;
+                }
+            }
+
             SRV_WRN("%{public}s", "no tokens to decode\n");
             return;
         }
@@ -2926,186 +4896,342 @@ struct server_context {
         if (slot_batched) {
             // make sure we're in the right embedding mode
             llama_set_embeddings(ctx, slot_batched->is_non_causal());
-            // apply lora, only need to do it once per batch
-            common_lora_adapters_apply(ctx, slot_batched->lora);
-        }
-
-        // process the created batch of tokens
-        for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
-            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
-
-            llama_batch batch_view = {
-                n_tokens,
-                batch.token    + i,
-                nullptr,
-                batch.pos      + i,
-                batch.n_seq_id + i,
-                batch.seq_id   + i,
-                batch.logits   + i,
-            };
-
-            const int ret = llama_decode(ctx, batch_view);
-            metrics.on_decoded(slots);
+        }
 
-            if (ret != 0) {
-                if (n_batch == 1 || ret < 0) {
-                    // if you get here, it means the KV cache is full - try increasing it via the context size
-                    SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %{public}d, n_batch = %{public}d, ret = %{public}d\n", i, n_batch, ret);
-                    for (auto & slot : slots) {
-                        slot.release();
-                        send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
+        // process the created batch of tokens, one group of adapters at a time
+        for (const auto & group : group_batch_by_lora()) {
+            // apply lora, only need to do it once per group
+            common_lora_adapters_apply(ctx, *group.lora);
+
+            for (int32_t i = group.i_begin; i < group.i_end; i += n_batch) {
+                const int32_t n_tokens = std::min(n_batch, group.i_end - i);
+
+                llama_batch batch_view = {
+                    n_tokens,
+                    batch.token    + i,
+                    nullptr,
+                    batch.pos      + i,
+                    batch.n_seq_id + i,
+                    batch.seq_id   + i,
+                    batch.logits   + i,
+                };
+
+                const int ret = llama_decode(ctx, batch_view);
+                metrics.on_decoded(slots);
+
+                if (ret != 0) {
+                    if (n_batch == 1 || ret < 0) {
+                        // if you get here, it means the KV cache is full - try increasing it via the context size
+                        SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %{public}d, n_batch = %{public}d, ret = %{public}d\n", i, n_batch, ret);
+                        for (auto & slot : slots) {
+                            slot.release();
+                            send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
+                        }
+                        return; // all the slots have been released, nothing left to decode
                     }
-                    break; // break loop of n_batch
-                }
-
-                // retry with half the batch size to try to find a free slot in the KV cache
-                n_batch /= 2;
-                i -= n_batch;
 
-                SRV_WRN("failed to find free space in the KV cache, retrying with smaller batch size - try increasing it via the context size or enable defragmentation, i = %{public}d, n_batch = %{public}d, ret = %{public}d\n", i, n_batch, ret);
+                    // retry with half the batch size to try to find a free slot in the KV cache
+                    n_batch /= 2;
+                    i -= n_batch;
 
-                continue; // continue loop of n_batch
-            }
+                    SRV_WRN("failed to find free space in the KV cache, retrying with smaller batch size - try increasing it via the context size or enable defragmentation, i = %{public}d, n_batch = %{public}d, ret = %{public}d\n", i, n_batch, ret);
 
-            for (auto & slot : slots) {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
-                    continue; // continue loop of slots
+                    continue; // continue loop of n_batch
                 }
 
-                if (slot.state == SLOT_STATE_DONE_PROMPT) {
-                    if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
-                        // prompt evaluated for embedding
-                        send_embedding(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
+                // the slots that sample their next token from this part of the batch
+                std::vector<server_slot *> slots_sample;
+
+                for (auto & slot : slots) {
+                    if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                         continue; // continue loop of slots
                     }
 
-                    if (slot.task_type == SERVER_TASK_TYPE_RERANK) {
-                        send_rerank(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
+                    if (slot.state == SLOT_STATE_DONE_PROMPT) {
+                        if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
+                            // prompt evaluated for embedding
+                            send_embedding(slot, batch_view);
+                            slot.release();
+                            slot.i_batch = -1;
+                            continue; // continue loop of slots
+                        }
+
+                        if (slot.task_type == SERVER_TASK_TYPE_RERANK) {
+                            send_rerank(slot, batch_view);
+                            slot.release();
+                            slot.i_batch = -1;
+                            continue; // continue loop of slots
+                        }
+
+                        // prompt evaluated for next-token prediction
+                        slot.state = SLOT_STATE_GENERATING;
+
+                        // the prompt is now in the KV cache and can be shared with other slots
+                        if (use_prefix_cache) {
+                            prefix_cache.insert(slot.id, slot.prompt_tokens, slot.n_prompt_tokens);
+                        }
+                    } else if (slot.state != SLOT_STATE_GENERATING) {
                         continue; // continue loop of slots
                     }
 
-                    // prompt evaluated for next-token prediction
-                    slot.state = SLOT_STATE_GENERATING;
-                } else if (slot.state != SLOT_STATE_GENERATING) {
-                    continue; // continue loop of slots
+                    slots_sample.push_back(&slot);
                 }
 
-                const int tok_idx = slot.i_batch - i;
+                // the samplers of the slots are independent of each other, run them in parallel
+                std::vector<llama_token> ids(slots_sample.size());
+                {
+                    const int n_vocab = llama_n_vocab(model);
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                    // the context is only accessed from this thread
+                    std::vector<const float *> logits(slots_sample.size());
+                    for (size_t k = 0; k < slots_sample.size(); ++k) {
+                        logits[k] = llama_get_logits_ith(ctx, slots_sample[k]->i_batch - i);
+                    }
 
-                slot.i_batch = -1;
+                    sampling_pool->parallel_for(slots_sample.size(), [&](size_t k) {
+                        ids[k] = common_sampler_sample_logits(slots_sample[k]->smpl, logits[k], n_vocab);
+                    });
+                }
 
-                common_sampler_accept(slot.smpl, id, true);
+                for (size_t k = 0; k < slots_sample.size(); ++k) {
+                    server_slot & slot = *slots_sample[k];
 
-                slot.n_decoded += 1;
+                    const int tok_idx = slot.i_batch - i;
 
-                const int64_t t_current = ggml_time_us();
+                    const llama_token id = ids[k];
 
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = t_current;
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+                    slot.i_batch = -1;
 
-                slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+                    common_sampler_accept(slot.smpl, id, true);
 
-                completion_token_output result;
-                result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, params_base.special);
-                result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+                    slot.n_decoded += 1;
 
-                if (slot.params.sampling.n_probs > 0) {
-                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
-                }
+                    const int64_t t_current = ggml_time_us();
 
-                if (!process_token(result, slot)) {
-                    // release slot because of stop condition
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
-                    continue;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = t_current;
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        metrics.on_prompt_eval(slot);
+                    }
+
+                    slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+
+                    completion_token_output result;
+                    result.tok          = id;
+                    result.text_to_send = token_pieces[params_base.special].get(result.tok);
+                    result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+
+                    if (slot.params.sampling.n_probs > 0) {
+                        populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
+                    }
+
+                    if (!process_token(result, slot)) {
+                        // release slot because of stop condition
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        continue;
+                    }
                 }
             }
+        }
 
-            // do speculative decoding
-            for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
-                    continue;
-                }
+        // do speculative decoding
+        // the drafts of all the slots are verified together, in as few decodes as possible
+        std::vector<server_draft> drafts;
 
-                if (slot.state != SLOT_STATE_GENERATING) {
-                    continue;
-                }
+        for (auto & slot : slots) {
+            if (!slot.is_processing() || !slot.can_speculate()) {
+                continue;
+            }
+
+            // only for the slots that were part of this batch
+            if (slot_batched == nullptr || slot_batched->is_non_causal() || !slot_batched->can_batch_with(slot)) {
+                continue;
+            }
 
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
+            if (slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
 
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+            // determine the max draft that fits the current slot state
+            int n_draft_max = slot.params.speculative.n_max;
 
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+            // note: n_past is not yet increased for the `id` token sampled above
+            //       also, need to leave space for 1 extra token to allow context shifts
+            n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
 
-                SLT_DBG(slot, "max possible draft: %{public}d\n", n_draft_max);
+            if (slot.n_remaining > 0) {
+                n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+            }
 
-                if (n_draft_max < slot.params.speculative.n_min) {
-                    SLT_DBG(slot, "the max possible draft is too small: %{public}d < %{public}d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+            // the draft and the sampled token are verified in a single decode
+            n_draft_max = std::min(n_draft_max, n_batch - 1);
 
-                    continue;
-                }
+            SLT_DBG(slot, "max possible draft: %{public}d\n", n_draft_max);
+
+            if (n_draft_max < slot.params.speculative.n_min) {
+                SLT_DBG(slot, "the max possible draft is too small: %{public}d < %{public}d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+
+                continue;
+            }
+
+            const int n_draft = slot.draft_controller.get_n_draft(slot.params.speculative.n_min, n_draft_max);
+            if (n_draft == 0) {
+                SLT_DBG(slot, "%{public}s", "speculation does not pay off at the current acceptance rate - skipping speculative decoding\n");
 
-                llama_token id = slot.sampled;
+                continue;
+            }
+
+            llama_token id = slot.sampled;
+
+            llama_tokens draft;
 
+            const int64_t t_draft_start = ggml_time_us();
+
+            std::vector<int> parents;
+
+            if (slot.params.speculative.ngram) {
+                draft = gen_draft_ngram(slot, id, n_draft);
+            } else {
                 struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                params_spec.n_draft   = n_draft;
+                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) / llama_n_seq_max(slot.ctx_dft) - slot.params.speculative.n_max;
                 params_spec.p_min     = slot.params.speculative.p_min;
 
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
+                if (slot.params.speculative.n_tree > 0) {
+                    // the candidates must fit in the batch as well
+                    params_spec.n_tree = std::min(slot.params.speculative.n_tree, n_batch - 1 - n_draft);
+
+                    draft = common_speculative_gen_draft_tree(slot.spec, params_spec, slot.cache_tokens, id, parents);
+                } else {
+                    draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
+                }
+            }
+
+            const int64_t t_draft_end = ggml_time_us();
+
+            // without candidates, the tree is a chain
+            if ((int) parents.size() == n_draft_chain(parents)) {
+                parents.clear();
+            }
+
+            slot.draft_controller.on_draft(draft.size(), (t_draft_end - t_draft_start) / 1e3);
+
+            // ignore small drafts
+            if (slot.params.speculative.n_min > (int) draft.size()) {
+                SLT_DBG(slot, "ignoring small draft: %{public}d < %{public}d\n", (int) draft.size(), slot.params.speculative.n_min);
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %{public}d < %{public}d\n", (int) draft.size(), slot.params.speculative.n_min);
+                continue;
+            }
+
+            drafts.push_back({ &slot, id, std::move(draft), std::move(parents), {}, (t_draft_end - t_draft_start) / 1e3, false });
+        }
+
+        for (size_t i_next = 0; i_next < drafts.size();) {
+            // the slots that use the same LoRA adapters as the first pending one, up to n_batch tokens
+            std::vector<common_lora_adapter_info> & lora = drafts[i_next].slot->lora;
+
+            std::vector<server_draft *> drafts_batch;
+
+            common_batch_clear(batch);
+
+            for (size_t k = i_next; k < drafts.size(); ++k) {
+                server_draft & d = drafts[k];
+                server_slot & slot = *d.slot;
 
+                if (d.batched || !are_lora_equal(slot.lora, lora) || batch.n_tokens + (int32_t) d.draft.size() + 1 > n_batch) {
                     continue;
                 }
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+                d.idxs.clear();
+
+                if (d.parents.empty()) {
+                    d.idxs.push_back(batch.n_tokens);
+                    common_batch_add(batch, d.id, slot.n_past, { slot.id }, true);
+
+                    for (size_t i = 0; i < d.draft.size(); ++i) {
+                        d.idxs.push_back(batch.n_tokens);
+                        common_batch_add(batch, d.draft[i], slot.n_past + 1 + i, { slot.id }, true);
+                    }
+                } else {
+                    add_draft_tree(d);
+                }
+
+                d.batched = true;
+                drafts_batch.push_back(&d);
+            }
+
+            while (i_next < drafts.size() && drafts[i_next].batched) {
+                ++i_next;
+            }
+
+            SRV_DBG("decoding speculative batch, n_slots = %zu, n_tokens = %{public}d\n", drafts_batch.size(), batch.n_tokens);
+
+            common_lora_adapters_apply(ctx, lora);
+
+            const int64_t t_decode_start = ggml_time_us();
+
+            const int ret = llama_decode(ctx, batch);
+
+            const int64_t t_decode_end = ggml_time_us();
+
+            if (ret != 0) {
+                // the sampled tokens are decoded again by the next batch, without speculation
+                SRV_ERR("failed to decode the speculative batch, n_tokens = %{public}d, ret = %{public}d\n", batch.n_tokens, ret);
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
+                for (server_draft * d : drafts_batch) {
+                    llama_kv_cache_seq_rm(ctx, d->slot->id, d->slot->n_past, -1);
+
+                    for (int j = 0; j < n_draft_tree_leaves(*d); ++j) {
+                        llama_kv_cache_seq_rm(ctx, draft_tree_seq_id(*d->slot, j), -1, -1);
+                    }
                 }
 
-                SLT_DBG(slot, "decoding speculative batch, size = %{public}d\n", slot.batch_spec.n_tokens);
+                continue;
+            }
+
+            for (server_draft * d : drafts_batch) {
+                server_slot & slot = *d->slot;
 
-                llama_decode(ctx, slot.batch_spec);
+                const int64_t t_sample_start = ggml_time_us();
 
                 // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                std::vector<llama_token> ids;
+
+                if (d->parents.empty()) {
+                    ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, d->idxs, d->draft);
+                } else {
+                    ids = accept_draft_tree(*d);
+                }
+
+                // the slot pays its share of the decode
+                const double t_verify = (t_decode_end - t_decode_start) / 1e3 * d->idxs.size() / batch.n_tokens + (ggml_time_us() - t_sample_start) / 1e3;
+
+                slot.draft_controller.on_verify(d->draft.size(), ids.size() - 1, t_verify);
 
                 slot.n_past    += ids.size();
                 slot.n_decoded += ids.size();
 
-                slot.cache_tokens.push_back(id);
+                slot.n_draft_total    += d->draft.size();
+                slot.n_draft_accepted += ids.size() - 1;
+                slot.n_draft_steps    += 1;
+
+                slot.t_draft_spec += d->t_draft + t_verify;
+                slot.t_draft_base += ids.size() * slot.draft_controller.t_verify(1);
+
+                slot.cache_tokens.push_back(d->id);
                 slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
 
                 llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+                slot.n_kv_shared = std::min(slot.n_kv_shared, slot.n_past);
 
                 for (size_t i = 0; i < ids.size(); ++i) {
                     completion_token_output result;
 
                     result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, params_base.special);
+                    result.text_to_send = token_pieces[params_base.special].get(result.tok);
                     result.prob         = 1.0f; // set later
 
                     // TODO: set result.probs
@@ -3120,7 +5246,7 @@ struct server_context {
                     }
                 }
 
-                SLT_DBG(slot, "accepted %{public}d/%{public}d draft tokens, new n_past = %{public}d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+                SLT_DBG(slot, "accepted %{public}d/%{public}d draft tokens, new n_past = %{public}d\n", (int) ids.size() - 1, (int) d->draft.size(), slot.n_past);
             }
         }
 
@@ -3357,7 +5483,7 @@ int main_function(int argc, char ** argv) {
         server_task task(SERVER_TASK_TYPE_METRICS);
         task.id = ctx_server.queue_tasks.get_new_id();
         ctx_server.queue_results.add_waiting_task_id(task.id);
-        ctx_server.queue_tasks.post(task, true); // high-priority task
+        ctx_server.queue_tasks.post(task);
 
         // get the result
         server_task_result_ptr result = ctx_server.queue_results.recv(task.id);
@@ -3395,7 +5521,7 @@ int main_function(int argc, char ** argv) {
         task.metrics_reset_bucket = true;
 
         ctx_server.queue_results.add_waiting_task_id(task.id);
-        ctx_server.queue_tasks.post(task, true); // high-priority task
+        ctx_server.queue_tasks.post(task);
 
         // get the result
         server_task_result_ptr result = ctx_server.queue_results.recv(task.id);
@@ -3410,6 +5536,8 @@ int main_function(int argc, char ** argv) {
         auto res_metrics = dynamic_cast<server_task_result_metrics*>(result.get());
         GGML_ASSERT(res_metrics != nullptr);
 
+        const size_t n_tasks_waiting = ctx_server.queue_results.n_waiting();
+
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
         json all_metrics_def = json {
             {"counter", {{
@@ -3436,6 +5564,38 @@ int main_function(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / (float) res_metrics->n_decode_total}
+            }, {
+                    {"name",  "completion_queue_seconds_total"},
+                    {"help",  "Time completion tasks waited before their prompt processing started"},
+                    {"value",  res_metrics->t_queued_cmpl_total / 1.e6}
+            }, {
+                    {"name",  "completion_queue_requests_total"},
+                    {"help",  "Number of completion tasks that started their prompt processing"},
+                    {"value",  res_metrics->n_queued_cmpl_total}
+            }, {
+                    {"name",  "embedding_queue_seconds_total"},
+                    {"help",  "Time embedding and rerank tasks waited before their prompt processing started"},
+                    {"value",  res_metrics->t_queued_embd_total / 1.e6}
+            }, {
+                    {"name",  "embedding_queue_requests_total"},
+                    {"help",  "Number of embedding and rerank tasks that started their prompt processing"},
+                    {"value",  res_metrics->n_queued_embd_total}
+            }, {
+                    {"name",  "requests_preempted_total"},
+                    {"help",  "Number of generating requests preempted by higher priority tasks"},
+                    {"value",  res_metrics->n_preempted_total}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of speculative draft tokens verified by the target model"},
+                    {"value",  res_metrics->n_draft_total}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of speculative draft tokens accepted by the target model"},
+                    {"value",  res_metrics->n_draft_accepted_total}
+            }, {
+                    {"name",  "draft_steps_total"},
+                    {"help",  "Number of speculative drafts verified by the target model"},
+                    {"value",  res_metrics->n_draft_steps_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3453,6 +5613,18 @@ int main_function(int argc, char ** argv) {
                     {"name",  "kv_cache_tokens"},
                     {"help",  "KV-cache tokens."},
                     {"value",  (uint64_t) res_metrics->kv_cache_tokens_count}
+            },{
+                    {"name",  "draft_acceptance_rate"},
+                    {"help",  "Fraction of the speculative draft tokens accepted by the target model."},
+                    {"value",  res_metrics->n_draft_total ? (double) res_metrics->n_draft_accepted_total / res_metrics->n_draft_total : 0.}
+            },{
+                    {"name",  "draft_tokens_per_step"},
+                    {"help",  "Average length of the speculative drafts."},
+                    {"value",  res_metrics->n_draft_steps_total ? (double) res_metrics->n_draft_total / res_metrics->n_draft_steps_total : 0.}
+            },{
+                    {"name",  "draft_speedup"},
+                    {"help",  "Estimated speedup of speculative decoding over generating the same tokens one at a time."},
+                    {"value",  res_metrics->t_draft_spec_total > 0. ? res_metrics->t_draft_base_total / res_metrics->t_draft_spec_total : 0.}
             },{
                     {"name",  "requests_processing"},
                     {"help",  "Number of request processing."},
@@ -3461,6 +5633,10 @@ int main_function(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "tasks_waiting_results"},
+                    {"help",  "Number of tasks whose results a request is waiting for."},
+                    {"value",  (uint64_t) n_tasks_waiting}
             }}}
         };
 
@@ -3692,8 +5868,19 @@ int main_function(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
+            const int32_t flush_ms   = tasks[0].params.stream_flush_ms;
+            const int32_t min_tokens = tasks[0].params.stream_min_tokens;
+
+            const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat, flush_ms, min_tokens](size_t, httplib::DataSink & sink) {
+                // the events of the partial results are written here directly, reused for the whole stream
+                std::string buf;
+
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
+                    buf.clear();
+                    if (result->write_sse(buf)) {
+                        return server_sent_events_write(sink, buf);
+                    }
+
                     json res_json = result->to_json();
                     if (res_json.is_array()) {
                         for (const auto & res : res_json) {
@@ -3707,7 +5894,7 @@ int main_function(int argc, char ** argv) {
                     }
                 }, [&](const json & error_data) {
                     server_sent_event(sink, "error", error_data);
-                });
+                }, flush_ms, min_tokens);
                 if (oaicompat != OAICOMPAT_TYPE_NONE) {
                     static const std::string ev_done = "data: [DONE]\n\n";
                     sink.write(ev_done.data(), ev_done.size());
@@ -3849,7 +6036,7 @@ int main_function(int argc, char ** argv) {
         res_ok(res, models);
     };
 
-    const auto handle_tokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
         json tokens_response = json::array();
@@ -3860,13 +6047,21 @@ int main_function(int argc, char ** argv) {
             llama_tokens tokens = tokenize_mixed(ctx_server.ctx, body.at("content"), add_special, true);
 
             if (with_pieces) {
+                // the content can hold token ids
+                for (const auto & token : tokens) {
+                    if (!ctx_server.token_pieces[true].contains(token)) {
+                        res_error(res, format_error_response(string_format("invalid token: %d", token), ERROR_TYPE_INVALID_REQUEST));
+                        return;
+                    }
+                }
+
                 for (const auto& token : tokens) {
-                    std::string piece = common_token_to_piece(ctx_server.ctx, token);
+                    const std::string_view piece = ctx_server.token_pieces[true].get(token);
                     json piece_json;
 
                     // Check if the piece is valid UTF-8
                     if (is_valid_utf8(piece)) {
-                        piece_json = piece;
+                        piece_json = std::string(piece);
                     } else {
                         // If not valid UTF-8, store as array of byte values
                         piece_json = json::array();
@@ -3889,13 +6084,20 @@ int main_function(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_detokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
         std::string content;
         if (body.count("tokens") != 0) {
             const llama_tokens tokens = body.at("tokens");
-            content = tokens_to_str(ctx_server.ctx, tokens.cbegin(), tokens.cend());
+            for (const auto & token : tokens) {
+                if (!ctx_server.token_pieces[true].contains(token)) {
+                    res_error(res, format_error_response(string_format("invalid token: %d", token), ERROR_TYPE_INVALID_REQUEST));
+                    return;
+                }
+            }
+
+            content = ctx_server.token_pieces[true].concat(tokens.cbegin(), tokens.cend());
         }
 
         const json data = format_detokenized_response(content);
@@ -0,0 +1,220 @@
+// behaviour test of the n-gram cache used for lookup decoding
+//
+// - a cache in the previous file format (a list of n-grams with the counts of all their following tokens) is converted
+//   on load with the same counts
+// - a cache saved in the table format loads with the same entries, and a loaded (mapped) cache can be modified without
+//   changing its file
+// - merging two caches adds their counts, whatever the format each of them was loaded from
+
+#include "ngram-cache.h"
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <vector>
+
+using ngram_key    = std::vector<llama_token>;
+using ngram_counts = std::map<ngram_key, std::map<llama_token, int32_t>>;
+
+static int n_failed = 0;
+
+#define TEST_CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            if (n_failed++ < 8) { \
+                fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+                fprintf(stderr, __VA_ARGS__); \
+                fprintf(stderr, "\n"); \
+            } \
+        } \
+    } while (0)
+
+static common_ngram to_ngram(const ngram_key & key) {
+    return common_ngram(key.data(), key.size());
+}
+
+// n-grams of 1 to LLAMA_NGRAM_MAX tokens; with few_followers, every n-gram is followed by at most LLAMA_NGRAM_TOP_K
+// distinct tokens, so that all the counts are tracked
+static ngram_counts make_counts(std::mt19937 & rng, int n_ngrams, bool few_followers) {
+    ngram_counts counts;
+
+    for (int i = 0; i < n_ngrams; ++i) {
+        ngram_key key(1 + rng() % LLAMA_NGRAM_MAX);
+        for (auto & tok : key) {
+            tok = rng() % 50;
+        }
+
+        const int n_followers = few_followers ? 1 + rng() % LLAMA_NGRAM_TOP_K : 1 + rng() % (3*LLAMA_NGRAM_TOP_K);
+        for (int j = 0; j < n_followers; ++j) {
+            const llama_token tok = few_followers ? j : rng() % 1000;
+            counts[key][tok] += 1 + rng() % 20;
+        }
+    }
+
+    return counts;
+}
+
+static void write_legacy(const std::string & path, const ngram_counts & counts) {
+    std::ofstream file(path, std::ios::binary);
+
+    for (const auto & it : counts) {
+        const common_ngram ngram = to_ngram(it.first);
+        file.write(reinterpret_cast<const char *>(&ngram), sizeof(ngram));
+
+        const int32_t ntokens = it.second.size();
+        file.write(reinterpret_cast<const char *>(&ntokens), sizeof(ntokens));
+
+        for (const auto & follower : it.second) {
+            file.write(reinterpret_cast<const char *>(&follower.first),  sizeof(llama_token));
+            file.write(reinterpret_cast<const char *>(&follower.second), sizeof(int32_t));
+        }
+    }
+}
+
+static common_ngram_cache make_cache(const ngram_counts & counts) {
+    common_ngram_cache cache;
+    for (const auto & it : counts) {
+        for (const auto & follower : it.second) {
+            cache.add(to_ngram(it.first), follower.first, follower.second);
+        }
+    }
+    return cache;
+}
+
+// the counts of the tracked followers must be exact when all of them are tracked, and never more than the real
+// ones otherwise; the total always is exact
+static void check_cache(const char * name, const common_ngram_cache & cache, const ngram_counts & counts) {
+    TEST_CHECK(cache.size() == counts.size(), "%s: %zu n-grams, expected %zu", name, cache.size(), counts.size());
+
+    for (const auto & it : counts) {
+        const common_ngram_entry * entry = cache.find(to_ngram(it.first));
+        TEST_CHECK(entry != nullptr, "%s: n-gram not found", name);
+        if (entry == nullptr) {
+            continue;
+        }
+
+        int32_t n_total = 0;
+        for (const auto & follower : it.second) {
+            n_total += follower.second;
+        }
+        TEST_CHECK(entry->n_total == n_total, "%s: n_total = %d, expected %d", name, entry->n_total, n_total);
+
+        const bool all_tracked = it.second.size() <= LLAMA_NGRAM_TOP_K;
+
+        int32_t n_tracked = 0;
+        for (int i = 0; i < LLAMA_NGRAM_TOP_K && entry->counts[i] > 0; ++i) {
+            const auto follower = it.second.find(entry->tokens[i]);
+            TEST_CHECK(follower != it.second.end(), "%s: unknown follower %d", name, entry->tokens[i]);
+            if (follower == it.second.end()) {
+                continue;
+            }
+
+            if (all_tracked) {
+                TEST_CHECK(entry->counts[i] == follower->second, "%s: count = %d, expected %d", name, entry->counts[i], follower->second);
+            }
+
+            TEST_CHECK(i == 0 || entry->counts[i] <= entry->counts[i - 1], "%s: the counts are not sorted", name);
+
+            n_tracked += entry->counts[i];
+        }
+
+        if (all_tracked) {
+            TEST_CHECK(n_tracked == n_total, "%s: %d tracked, expected %d", name, n_tracked, n_total);
+        }
+        TEST_CHECK(n_tracked <= n_total, "%s: %d tracked, more than the total %d", name, n_tracked, n_total);
+    }
+}
+
+static bool same_entries(const common_ngram_cache & a, const common_ngram_cache & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+
+    const common_ngram_entry * table = a.data();
+    for (size_t i = 0; i < a.capacity(); ++i) {
+        if (table[i].empty()) {
+            continue;
+        }
+
+        const common_ngram_entry * other = b.find(table[i].ngram);
+        if (other == nullptr || other->n_total != table[i].n_total) {
+            return false;
+        }
+        for (int k = 0; k < LLAMA_NGRAM_TOP_K; ++k) {
+            if (other->counts[k] != table[i].counts[k] || (table[i].counts[k] > 0 && other->tokens[k] != table[i].tokens[k])) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    const std::string dir = argc > 1 ? argv[1] : ".";
+
+    std::string path_legacy = dir + "/ngram-cache-test-legacy.bin";
+    std::string path_table  = dir + "/ngram-cache-test-table.bin";
+
+    std::mt19937 rng(42);
+
+    for (const bool few_followers : { true, false }) {
+        const ngram_counts counts_a = make_counts(rng, 5000, few_followers);
+        const ngram_counts counts_b = make_counts(rng, 5000, few_followers);
+
+        ngram_counts counts_sum = counts_a;
+        for (const auto & it : counts_b) {
+            for (const auto & follower : it.second) {
+                counts_sum[it.first][follower.first] += follower.second;
+            }
+        }
+
+        // the previous format is converted on load
+        write_legacy(path_legacy, counts_a);
+        common_ngram_cache cache_a = common_ngram_cache_load(path_legacy);
+        check_cache("legacy load", cache_a, counts_a);
+
+        // the table format loads with the same entries
+        common_ngram_cache_save(cache_a, path_table);
+        common_ngram_cache cache_table = common_ngram_cache_load(path_table);
+        TEST_CHECK(same_entries(cache_a, cache_table), "table load: the entries differ");
+
+        // merging into a mapped cache copies it, the file is not modified
+        common_ngram_cache cache_b = make_cache(counts_b);
+        check_cache("add", cache_b, counts_b);
+
+        common_ngram_cache_merge(cache_table, cache_b);
+        if (few_followers) {
+            check_cache("merge", cache_table, counts_sum);
+        } else {
+            // the followers that are no longer tracked only count in the total
+            TEST_CHECK(cache_table.size() == counts_sum.size(), "merge: %zu n-grams, expected %zu", cache_table.size(), counts_sum.size());
+            for (const auto & it : counts_sum) {
+                const common_ngram_entry * entry = cache_table.find(to_ngram(it.first));
+                int32_t n_total = 0;
+                for (const auto & follower : it.second) {
+                    n_total += follower.second;
+                }
+                TEST_CHECK(entry != nullptr && entry->n_total == n_total, "merge: wrong n_total");
+            }
+        }
+
+        common_ngram_cache cache_reload = common_ngram_cache_load(path_table);
+        TEST_CHECK(same_entries(cache_a, cache_reload), "the file of the mapped cache was modified by the merge");
+
+        // merging the converted cache into another one adds the same counts
+        if (few_followers) {
+            common_ngram_cache cache_legacy_merged = make_cache(counts_b);
+            common_ngram_cache_merge(cache_legacy_merged, cache_a);
+            check_cache("legacy merge", cache_legacy_merged, counts_sum);
+        }
+    }
+
+    std::remove(path_legacy.c_str());
+    std::remove(path_table.c_str());
+
+    printf("%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+// golden test of the direct SSE serializer of the partial results of a stream
+//
+// server_task_result_cmpl_partial::write_sse() must give the same bytes as server_sent_event() of to_json(), which is
+// what the server sends when there is no direct output, for the native, OAI completion and OAI chat shapes, with and
+// without probs and timings, and for content with control characters, quotes, backslashes, multi-byte characters and
+// invalid or incomplete UTF-8
+
+#include "hilog/log.h"
+
+#undef LOG_DOMAIN
+#undef LOG_TAG
+#define LOG_DOMAIN 0x3200
+#define LOG_TAG "SSE_TEST"
+
+#include "../server.cpp"
+
+#include <cstdio>
+#include <random>
+
+// the events of to_json(), as written by the stream handler without write_sse()
+static std::string sse_json(server_task_result & result) {
+    std::string out;
+
+    httplib::DataSink sink;
+    sink.write = [&out](const char * data, size_t size) {
+        out.append(data, size);
+        return true;
+    };
+
+    const json res_json = result.to_json();
+    if (res_json.is_array()) {
+        for (const auto & res : res_json) {
+            server_sent_event(sink, "data", res);
+        }
+    } else {
+        server_sent_event(sink, "data", res_json);
+    }
+
+    return out;
+}
+
+static result_timings make_timings(int prompt_n, bool draft) {
+    result_timings timings;
+    timings.prompt_n               = prompt_n;
+    timings.prompt_ms              = 1.5;
+    timings.prompt_per_token_ms    = 0.1;
+    timings.prompt_per_second      = 1e-5;
+    timings.predicted_n            = 3;
+    timings.predicted_ms           = 2.25;
+    timings.predicted_per_token_ms = 1e20;
+    timings.predicted_per_second   = 1.0/3.0;
+    if (draft) {
+        timings.draft_n          = 8;
+        timings.draft_n_accepted = 5;
+        timings.draft_n_steps    = 2;
+    }
+    return timings;
+}
+
+static completion_token_output make_probs(const std::string & text) {
+    completion_token_output out;
+    out.tok          = 5;
+    out.prob         = 0.25f;
+    out.text_to_send = text;
+    out.probs.push_back({ 7, "x\xC3",    0.125f });
+    out.probs.push_back({ 8, "\"\\\n",   0.0f   });
+    out.probs.push_back({ 9, "\xF0\x9F", 1e-9f  });
+    return out;
+}
+
+int main(int argc, char ** argv) {
+    const int n_random = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+    const std::vector<std::string> contents = {
+        "",
+        "hello",
+        " w\xC3\xB6rld",
+        "\"quoted\"",
+        "back\\slash",
+        "/",
+        "\n\t\r\b\f",
+        std::string("\x00\x01\x1f\x7f", 4),
+        "\xE6\x97\xA5\xE6\x9C\xAC",     // two 3-byte characters
+        "\xF0\x9F\x98\x80",             // 4-byte character
+        "\xC3",                         // incomplete 2-byte character
+        "\xE6\x97",                     // incomplete 3-byte character
+        "\xA9",                         // continuation byte alone
+        "\xED\xA0\x80",                 // surrogate
+        "\xC0\xAF",                     // overlong
+        "\xF4\x90\x80\x80",             // beyond U+10FFFF
+        "\xFF",
+    };
+
+    int n_checked    = 0;
+    int n_mismatches = 0;
+
+    const auto check = [&](server_task_result_cmpl_partial & result) {
+        for (int attempt = 0; ; ++attempt) {
+            std::string direct;
+            if (!result.write_sse(direct)) {
+                return;
+            }
+
+            // "created" can change between the two calls
+            const std::string ref = sse_json(result);
+            if (ref == direct) {
+                break;
+            }
+
+            if (attempt > 0) {
+                if (n_mismatches++ < 4) {
+                    fprintf(stderr, "mismatch:\njson:   %s\ndirect: %s\n", ref.c_str(), direct.c_str());
+                }
+                break;
+            }
+        }
+
+        n_checked++;
+    };
+
+    // all the shapes, with and without probs and timings, with each content
+    for (const auto type : { OAICOMPAT_TYPE_NONE, OAICOMPAT_TYPE_COMPLETION, OAICOMPAT_TYPE_CHAT }) {
+        for (int with_probs = 0; with_probs < 2; ++with_probs) {
+            for (const int prompt_n : { -1, 0, 4 }) {
+                for (const auto & content : contents) {
+                    server_task_result_cmpl_partial result;
+                    result.id                  = 1;
+                    result.id_slot             = 2;
+                    result.index               = 1;
+                    result.content             = content;
+                    result.tokens              = { 1, 32000, 7 };
+                    result.n_decoded           = 3;
+                    result.n_prompt_tokens     = 12;
+                    result.post_sampling_probs = with_probs && prompt_n > 0;
+                    result.timings             = make_timings(prompt_n, prompt_n > 0);
+                    result.oaicompat           = type;
+                    result.oaicompat_model     = "gpt-3.5-turbo";
+                    result.oaicompat_cmpl_id   = "chatcmpl-0123456789abcdef";
+
+                    if (with_probs) {
+                        result.probs_output.push_back(make_probs(content));
+                        result.probs_output.push_back(make_probs("\"\xC3"));
+                    }
+
+                    check(result);
+                }
+            }
+        }
+    }
+
+    // the results without direct output
+    {
+        server_task_result_cmpl_partial result;
+        result.n_decoded = 1;
+        result.oaicompat = OAICOMPAT_TYPE_COMPLETION;
+        result.verbose   = true;
+
+        std::string direct;
+        if (result.write_sse(direct)) {
+            fprintf(stderr, "verbose OAI completions must use to_json()\n");
+            n_mismatches++;
+        }
+
+        result.oaicompat = OAICOMPAT_TYPE_CHAT;
+        result.verbose   = false;
+        result.n_decoded = 0;
+        if (result.write_sse(direct)) {
+            fprintf(stderr, "the first chat chunk must use to_json()\n");
+            n_mismatches++;
+        }
+    }
+
+    // random concatenations of the contents, random fields
+    std::mt19937 rng(42);
+    for (int i = 0; i < n_random; ++i) {
+        server_task_result_cmpl_partial result;
+        result.id      = rng() % 100;
+        result.id_slot = rng() % 4;
+        result.index   = rng() % 3;
+
+        const int n_tokens = 1 + rng() % 4;
+        for (int k = 0; k < n_tokens; ++k) {
+            result.content += contents[rng() % contents.size()];
+            result.tokens.push_back(rng() % 100000);
+        }
+
+        result.n_decoded           = 1 + rng() % 100;
+        result.n_prompt_tokens     = rng() % 1000;
+        result.post_sampling_probs = rng() % 2;
+
+        if (rng() % 3 == 0) {
+            result.probs_output.push_back(make_probs(contents[rng() % contents.size()]));
+        }
+        if (rng() % 3 == 0) {
+            result.timings = make_timings(rng() % 5, rng() % 2);
+        }
+
+        result.oaicompat         = (oaicompat_type) (rng() % 3);
+        result.oaicompat_model   = contents[rng() % contents.size()];
+        result.oaicompat_cmpl_id = "chatcmpl-" + std::to_string(rng());
+
+        check(result);
+    }
+
+    printf("checked %d events, %d mismatches\n", n_checked, n_mismatches);
+
+    return n_mismatches == 0 ? 0 : 1;
+}
@@ -86,6 +86,96 @@ def test_completion_stream_vs_non_stream():
     assert content_stream == res_non_stream.body["content"]
 
 
+@pytest.mark.parametrize("stream", [False, True])
+def test_completion_stop_words(stream: bool):
+    global server
+    server.start()
+    data = {
+        "n_predict": 32,
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content = res.body["content"]
+
+    # the stop words can span several tokens, the held back text of a partial match must not be sent
+    word = content[10:16]
+    data = {**data, "stop": ["<never>", word[:3] + "<never>", word], "stream": stream}
+    if stream:
+        content_stop = ""
+        for chunk in server.make_stream_request("POST", "/completion", data=data):
+            content_stop += chunk["content"]
+            if chunk["stop"]:
+                res_stop = chunk
+    else:
+        res_stop = server.make_request("POST", "/completion", data=data).body
+        content_stop = res_stop["content"]
+    assert content_stop == content[:content.find(word)]
+    assert res_stop["stop_type"] == "word"
+    assert res_stop["stopping_word"] == word
+
+
+@pytest.mark.parametrize("stream_flush_ms,stream_min_tokens", [
+    (0, 4),
+    (10000, 4),
+    (10000, 0),
+])
+def test_completion_stream_coalesced(stream_flush_ms: int, stream_min_tokens: int):
+    global server
+    server.start()
+    data = {
+        "n_predict": 16,
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+
+    content = ""
+    n_events = 0
+    for chunk in server.make_stream_request("POST", "/completion", data={
+        **data,
+        "stream": True,
+        "stream_flush_ms": stream_flush_ms,
+        "stream_min_tokens": stream_min_tokens,
+    }):
+        if chunk["stop"]:
+            assert chunk["timings"]["predicted_n"] == 16
+        else:
+            assert stream_min_tokens == 0 or len(chunk["tokens"]) <= stream_min_tokens
+            n_events += 1
+        content += chunk["content"]
+    assert content == res.body["content"]
+    # the tokens of the partial events are coalesced
+    assert n_events < 16
+
+
+@pytest.mark.parametrize("path,data", [
+    ("/completion", {"prompt": "I believe the meaning of life is"}),
+    ("/v1/completions", {"prompt": "I believe the meaning of life is"}),
+    ("/v1/chat/completions", {"messages": [{"role": "user", "content": "What is the meaning of life?"}]}),
+])
+def test_completion_stream_events_compact(path: str, data: dict):
+    global server
+    server.start()
+    url = f"http://{server.server_host}:{server.server_port}{path}"
+    response = requests.post(url, json={**data, "max_tokens": 8, "n_predict": 8, "stream": True}, stream=True)
+    assert response.status_code == 200
+    n_events = 0
+    for line_bytes in response.iter_lines():
+        line = line_bytes.decode("utf-8")
+        if not line.startswith("data: ") or "[DONE]" in line:
+            continue
+        # the partial events are written without building a json object, they must be the same as json::dump()
+        payload = line[6:]
+        assert payload == json.dumps(json.loads(payload), separators=(",", ":"), ensure_ascii=False)
+        n_events += 1
+    assert n_events > 1
+
+
 def test_completion_stream_with_openai_library():
     global server
     server.start()
@@ -155,6 +245,58 @@ def test_different_result_different_seed(n_slots: int):
             assert res.body["content"] != last_res.body["content"]
         last_res = res
 
+
+def test_same_seed_parallel_vs_sequential_sampling():
+    global server
+    server.n_slots = 2
+    server.n_threads = 2
+    server.start()
+
+    # the slots decoded in the same batch run their samplers in parallel, the outputs must be the same as when
+    # each request runs alone
+    res_single = assert_parallel_matches_single(server, "/completion", [{
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 32,
+        "ignore_eos": True,
+        "seed": seed,
+        "temperature": 1.0,
+        "cache_prompt": False,  # TODO: remove this once test_cache_vs_nocache_prompt is fixed
+    } for seed in [42, 43]])
+    assert res_single[0].body["content"] != res_single[1].body["content"]
+
+
+@pytest.mark.parametrize("sampling", [
+    {"top_k": 40},
+    {"top_k": 5, "min_p": 0.05},
+    {"top_k": 0, "min_p": 0.05},
+    {"top_k": 40, "repeat_penalty": 1.5, "repeat_last_n": 16},
+    {"top_k": 40, "logit_bias": [[13, -2.0], [29892, -100.0]]},
+])
+def test_prefiltered_vs_full_vocab_sampling(sampling: dict):
+    global server
+    server.start()
+
+    # a DRY sampler that never applies (no repetition is longer than dry_allowed_length) makes the sampler use the
+    # full vocabulary instead of the prefiltered candidates, the outputs must be the same
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 32,
+        "ignore_eos": True,
+        "seed": 42,
+        "temperature": 1.0,
+        "dry_multiplier": 0.0,
+        **sampling,
+    }
+    res_prefiltered = server.make_request("POST", "/completion", data=data)
+    res_full_vocab = server.make_request("POST", "/completion", data={
+        **data,
+        "dry_multiplier": 0.8,
+        "dry_allowed_length": 1000,
+    })
+    assert res_prefiltered.status_code == 200
+    assert res_full_vocab.status_code == 200
+    assert res_prefiltered.body["content"] == res_full_vocab.body["content"]
+
 # TODO figure why it don't work with temperature = 1
 # @pytest.mark.parametrize("temperature", [0.0, 1.0])
 @pytest.mark.parametrize("n_batch", [16, 32])
@@ -293,6 +435,335 @@ def test_completion_parallel_slots(n_slots: int, n_requests: int):
         # assert match_regex(re_content, res.body["content"])
 
 
+def test_completion_parallel_slots_prefill_budget():
+    global server
+    server.n_slots = 2
+    server.prefill_budget = 4
+    server.temperature = 0.0
+    server.start()
+
+    prompt = "Write a very long book about the meaning of life, with many chapters"
+    tasks = []
+    for i in range(2):
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": prompt,
+            "n_predict": 16,
+            "id_slot": i,
+            "cache_prompt": False,
+        })))
+    results = parallel_function_calls(tasks)
+
+    # the prompts are processed in chunks, but all the prompt tokens must be processed
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["timings"]["prompt_n"] == results[0].body["timings"]["prompt_n"]
+
+
+def test_completion_prefill_budget_while_generating():
+    global server
+    server.n_slots = 2
+    server.n_ctx = 4096
+    server.n_predict = -1
+    server.prefill_budget = 4
+    server.temperature = 0.0
+    server.server_metrics = True
+    server.start()
+
+    url = f"http://{server.server_host}:{server.server_port}"
+
+    # number of llama_decode() calls, and of busy slots summed over them
+    def get_decode_metrics():
+        metrics = requests.get(f"{url}/metrics").text
+        n_decode = float(re.search(r"^llamacpp:n_decode_total (\S+)$", metrics, re.MULTILINE).group(1))
+        n_busy_per_decode = float(re.search(r"^llamacpp:n_busy_slots_per_decode (\S+)$", metrics, re.MULTILINE).group(1))
+        n_processing = float(re.search(r"^llamacpp:requests_processing (\S+)$", metrics, re.MULTILINE).group(1))
+        return n_decode, round(n_busy_per_decode * n_decode), n_processing
+
+    with requests.post(f"{url}/completion", json={
+        "prompt": "Write a very long book.",
+        "n_predict": 1900,
+        "ignore_eos": True,
+        "id_slot": 0,
+        "stream": True,
+    }, stream=True) as response:
+        assert response.status_code == 200
+
+        # wait until slot 0 is generating
+        for line_bytes in response.iter_lines():
+            if line_bytes.decode("utf-8").startswith("data: "):
+                break
+
+        n_decode_0, n_busy_0, _ = get_decode_metrics()
+        res = server.make_request("POST", "/completion", data={
+            "prompt": "Write a very long book about the meaning of life, with many chapters. " * 6,
+            "n_predict": 1,
+            "id_slot": 1,
+            "cache_prompt": False,
+        })
+        n_decode_1, n_busy_1, n_processing = get_decode_metrics()
+
+    assert res.status_code == 200
+    n_prompt = res.body["timings"]["prompt_n"]
+    assert n_prompt > 4 * 8
+
+    # slot 0 generated a token in every decode of the interval, the decodes where slot 1 was busy as well are the ones
+    # that processed its prompt, at most prefill_budget tokens at a time
+    assert n_processing == 1
+    assert (n_busy_1 - n_busy_0) - (n_decode_1 - n_decode_0) >= (n_prompt + 3) // 4
+
+
+def test_embedding_while_generating():
+    global server
+    server.n_slots = 2
+    server.n_ctx = 4096
+    server.n_predict = -1
+    server.pooling = "last"
+    server.temperature = 0.0
+    server.server_metrics = True
+    server.start()
+
+    url = f"http://{server.server_host}:{server.server_port}"
+
+    def get_metric(metrics: str, name: str) -> float:
+        match = re.search(rf"^llamacpp:{name} (\S+)$", metrics, re.MULTILINE)
+        assert match is not None, f"metric {name} is not exported"
+        return float(match.group(1))
+
+    with requests.post(f"{url}/completion", json={
+        "prompt": "Write a very long book.",
+        "n_predict": 1900,
+        "ignore_eos": True,
+        "stream": True,
+    }, stream=True) as response:
+        assert response.status_code == 200
+        lines = response.iter_lines()
+
+        # wait until the completion is generating
+        for line_bytes in lines:
+            if line_bytes.decode("utf-8").startswith("data: "):
+                break
+
+        # the embeddings cannot share a batch with the completion, they are batched in alternate iterations instead of
+        # waiting for the completion to finish
+        for content in ["I believe the meaning of life is", "This is a test", "This is another test"]:
+            res = server.make_request("POST", "/embedding", data={"content": content})
+            assert res.status_code == 200
+            assert len(res.body) == 1
+            assert len(res.body[0]["embedding"]) > 0
+
+        metrics = requests.get(f"{url}/metrics").text
+        assert get_metric(metrics, "requests_processing") == 1
+
+        last = None
+        for line_bytes in lines:
+            line = line_bytes.decode("utf-8")
+            if line.startswith("data: ") and "[DONE]" not in line:
+                last = json.loads(line[6:])
+        assert last is not None and last["stop"]
+        assert last["tokens_predicted"] == 1900
+
+    metrics = requests.get(f"{url}/metrics").text
+    assert get_metric(metrics, "completion_queue_requests_total") == 1
+    assert get_metric(metrics, "completion_queue_seconds_total") > 0
+    assert get_metric(metrics, "embedding_queue_requests_total") == 3
+    assert get_metric(metrics, "embedding_queue_seconds_total") > 0
+
+
+def test_completion_priority_preemption():
+    global server
+    server.n_slots = 1
+    server.n_ctx = 4096
+    server.n_predict = -1
+    server.temperature = 0.0
+    server.server_metrics = True
+    server.start()
+
+    url = f"http://{server.server_host}:{server.server_port}"
+    data_low = {
+        "prompt": "Write a very long book.",
+        "n_predict": 2048,
+        "ignore_eos": True,
+        "priority": 0,
+    }
+
+    # the output of the low priority request when it runs alone
+    res_alone = server.make_request("POST", "/completion", data={**data_low, "cache_prompt": False})
+    assert res_alone.status_code == 200
+
+    with requests.post(f"{url}/completion", json={**data_low, "cache_prompt": False, "stream": True}, stream=True) as response:
+        assert response.status_code == 200
+        lines = response.iter_lines()
+
+        # wait until the low priority request is generating in the only slot
+        content = ""
+        for line_bytes in lines:
+            line = line_bytes.decode("utf-8")
+            if line.startswith("data: "):
+                content += json.loads(line[6:])["content"]
+                break
+
+        # the high priority request does not wait for the low priority one to finish
+        res_high = server.make_request("POST", "/completion", data={
+            "prompt": "What is LLM?",
+            "n_predict": 8,
+            "priority": 1,
+        })
+        assert res_high.status_code == 200
+        assert res_high.body["tokens_predicted"] == 8
+        assert res_high.body["generation_settings"]["priority"] == 1
+
+        # the low priority request is resumed where it was preempted
+        last = None
+        for line_bytes in lines:
+            line = line_bytes.decode("utf-8")
+            if line.startswith("data: ") and "[DONE]" not in line:
+                last = json.loads(line[6:])
+                content += last["content"]
+        assert last is not None and last["stop"]
+        assert last["tokens_predicted"] == 2048
+        assert last["generation_settings"]["priority"] == 0
+        assert content == res_alone.body["content"]
+
+    metrics = requests.get(f"{url}/metrics").text
+    assert "llamacpp:requests_preempted_total 1" in metrics
+
+
+@pytest.mark.parametrize("stream", [False, True])
+def test_completion_parallel_results_routing(stream: bool):
+    global server
+    server.n_slots = 2
+    server.temperature = 0.0
+    server.start()
+
+    PROMPTS = [
+        "Write a very long book.",
+        "Write another a poem.",
+        "What is LLM?",
+        "The sky is blue and I love it.",
+        "Write another very long music lyrics.",
+        "Write a very long joke.",
+    ]
+
+    def make_request(prompt: str, n_predict: int):
+        data = {
+            "prompt": prompt,
+            "n_predict": n_predict,
+            "ignore_eos": True,
+            "cache_prompt": False,
+        }
+        if not stream:
+            return server.make_request("POST", "/completion", data=data).body
+        content = ""
+        last = None
+        for chunk in server.make_stream_request("POST", "/completion", data={**data, "stream": True}):
+            content += chunk["content"]
+            last = chunk
+        assert last is not None
+        return {**last, "content": content}
+
+    tasks = [(make_request, (prompt, 4 + 3*i)) for i, prompt in enumerate(PROMPTS)]
+    results = parallel_function_calls(tasks)
+
+    # every request must get the results of its own task, while the results of the other ones arrive in between
+    for i, prompt in enumerate(PROMPTS):
+        body = results[i]
+        assert body["generation_settings"]["n_predict"] == 4 + 3*i
+        assert body["tokens_predicted"] == 4 + 3*i
+        assert prompt in body["prompt"]
+
+
+def test_completion_cancelled_stream_channel_released():
+    global server
+    server.n_slots = 1
+    server.n_predict = -1
+    server.server_metrics = True
+    server.start()
+
+    url = f"http://{server.server_host}:{server.server_port}"
+    with requests.post(f"{url}/completion", json={
+        "prompt": "Write a very long book.",
+        "n_predict": -1,
+        "ignore_eos": True,
+        "stream": True,
+    }, stream=True) as response:
+        assert response.status_code == 200
+        for line_bytes in response.iter_lines():
+            if line_bytes.decode("utf-8").startswith("data: "):
+                break
+
+    # closing the connection cancels the task, its results must no longer be waited for
+    metrics = ""
+    for _ in range(50):
+        metrics = requests.get(f"{url}/metrics").text
+        if "llamacpp:tasks_waiting_results 0" in metrics and "llamacpp:requests_processing 0" in metrics:
+            break
+        time.sleep(0.1)
+    assert "llamacpp:tasks_waiting_results 0" in metrics
+    assert "llamacpp:requests_processing 0" in metrics
+
+    # the slot is free again
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is LLM?",
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert res.body["tokens_predicted"] == 4
+
+
+def test_completion_prefix_shared_between_slots():
+    global server
+    server.n_slots = 2
+    server.temperature = 0.0
+    server.start()
+    prompt = "Write a very long book about the meaning of life, with many chapters"
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    n_prompt = res.body["timings"]["prompt_n"]
+    assert n_prompt > 1
+
+    # the same prompt on another slot must reuse the KV cache of slot 0
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 1,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1
+
+
+def test_completion_slot_selected_by_prompt_similarity():
+    global server
+    server.n_slots = 2
+    server.start()
+    prompt = "Write a very long book about the meaning of life, with many chapters"
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    id_slot = res.body["id_slot"]
+
+    # an unrelated prompt goes to the least recently used slot
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert res.body["id_slot"] != id_slot
+
+    # a similar prompt goes back to the slot holding the first prompt
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt + ", and an epilogue",
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert res.body["id_slot"] == id_slot
+
+
 @pytest.mark.parametrize(
     "prompt,n_predict,response_fields",
     [
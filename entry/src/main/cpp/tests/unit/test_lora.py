@@ -66,6 +66,25 @@ def test_lora_per_request():
         assert match_regex(re_test, res.body["content"])
 
 
+def test_lora_per_request_same_batch():
+    global server
+    server.n_slots = 2
+    server.start()
+
+    # the two requests are submitted together, their tokens are decoded in the same batches with a different lora
+    # scale for each sequence, each one must give the same output as when it runs alone
+    res_single = assert_parallel_matches_single(server, "/completion", [{
+        "prompt": "Look in thy glass",
+        "lora": [{"id": 0, "scale": scale}],
+        "n_predict": 32,
+        "ignore_eos": True,
+        "seed": 42,
+        "temperature": 0.0,
+        "cache_prompt": False, # TODO: remove this once test_cache_vs_nocache_prompt is fixed
+    } for scale in [0.0, 1.0]])
+    assert res_single[0].body["content"] != res_single[1].body["content"]
+
+
 @pytest.mark.skipif(not is_slow_test_allowed(), reason="skipping slow test")
 def test_with_big_model():
     server = ServerProcess()
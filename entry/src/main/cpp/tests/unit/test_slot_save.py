@@ -1,4 +1,5 @@
 import pytest
+import shutil
 from utils import *
 
 server = ServerPreset.tinyllama2()
@@ -96,3 +97,49 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+def test_slot_cache_spill_restore():
+    global server
+    server.n_slots = 1
+    server.slot_cache_path = "./tmp/slot-cache"
+    # the files of a previous run would be loaded, the first prompt must not be cached yet
+    shutil.rmtree(server.slot_cache_path, ignore_errors=True)
+    os.makedirs(server.slot_cache_path)
+    server.start()
+
+    prompt_a = "Once upon a time, there was a little girl named Lily. " * 6
+    prompt_b = "The big brown dog ran in the park and played with a red ball. " * 6
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt_a,
+        "n_predict": 4,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    n_prompt_a = res.body["timings"]["prompt_n"]
+    assert n_prompt_a > 64
+
+    # the only slot is evicted, its state is spilled to disk
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt_b,
+        "n_predict": 4,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    # the state is written in the background
+    for _ in range(100):
+        if any(name.endswith(".kvc") for name in os.listdir(server.slot_cache_path)):
+            break
+        time.sleep(0.1)
+    assert any(name.endswith(".kvc") for name in os.listdir(server.slot_cache_path))
+
+    # the first prompt is restored from disk instead of being evaluated again
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt_a,
+        "n_predict": 4,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1
@@ -48,6 +48,60 @@ def test_with_and_without_draft():
     assert content_no_draft == content_draft
 
 
+@pytest.mark.parametrize("n_slots", [1, 2])
+def test_with_and_without_draft_tree(n_slots: int):
+    global server
+    server.n_slots = n_slots
+    server.draft_tree = 4
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+    }
+    res = server.make_request("POST", "/completion", data={**data, "speculative.n_tree": 0})
+    assert res.status_code == 200
+    content_chain = res.body["content"]
+
+    # the candidates of the tree must not change the output
+    tasks = [(server.make_request, ("POST", "/completion", {**data, "id_slot": i})) for i in range(n_slots)]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["content"] == content_chain
+        assert res.body["generation_settings"]["speculative.n_tree"] == 4
+
+
+def test_with_and_without_ngram_draft():
+    global server
+    server.model_draft = None  # draft from the n-gram cache only
+    server.start()
+    prompt = "One, two, three, four. One, two, three, four. One, two, three, four. One, two,"
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "temperature": 0.0,
+        "top_k": 1,
+    })
+    assert res.status_code == 200
+    content_no_draft = res.body["content"]
+    assert "draft_n" not in res.body["timings"]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "temperature": 0.0,
+        "top_k": 1,
+        "speculative.ngram": True,
+        "speculative.n_min": 2,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content_no_draft
+    assert res.body["timings"]["draft_n"] > 0
+    assert 0 <= res.body["timings"]["draft_n_accepted"] <= res.body["timings"]["draft_n"]
+    assert 2 <= res.body["timings"]["draft_n_avg"] <= server.draft_max
+    assert res.body["timings"]["draft_speedup"] > 0
+
+
 def test_different_draft_min_draft_max():
     global server
     test_values = [
@@ -124,3 +178,81 @@ def test_multi_requests_parallel(n_slots: int, n_requests: int):
     for res in results:
         assert res.status_code == 200
         assert match_regex("(wise|kind|owl|answer)+", res.body["content"])
+
+
+def test_multi_requests_parallel_verified_together():
+    global server
+    server.n_slots = 4
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content = res.body["content"]
+
+    # the drafts of all the slots are verified in the same batch, which must not change the output
+    tasks = [(server.make_request, ("POST", "/completion", {**data, "id_slot": i})) for i in range(4)]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["content"] == content
+        assert res.body["timings"]["draft_n"] > 0
+
+
+def test_draft_prefix_shared_across_slots():
+    global server
+    server.n_slots = 2
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+    }
+    # the draft model of slot 1 starts from the prefix cached by slot 0, in the shared draft context
+    results = []
+    for id_slot in [0, 1, 1, 0]:
+        res = server.make_request("POST", "/completion", data={**data, "id_slot": id_slot})
+        assert res.status_code == 200
+        assert res.body["timings"]["draft_n"] > 0
+        results.append(res.body["content"])
+    assert all(content == results[0] for content in results)
+
+
+def test_ngram_draft_with_dynamic_cache():
+    global server
+    server.model_draft = None  # draft from the n-gram caches only
+    server.lookup_cache_dynamic = "./tmp/ngram-cache-dynamic.bin"
+    if os.path.exists(server.lookup_cache_dynamic):
+        os.remove(server.lookup_cache_dynamic)
+    os.makedirs("./tmp", exist_ok=True)
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+        "speculative.ngram": True,
+        "speculative.n_min": 2,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content = res.body["content"]
+
+    # the cache is saved once the server is idle
+    time.sleep(1)
+    assert os.path.getsize(server.lookup_cache_dynamic) > 0
+
+    # a restarted server picks up the n-grams of the previous generation, the
+    # dynamic cache needs to have seen an n-gram twice before drafting from it
+    server.stop()
+    server.start()
+    for _ in range(2):
+        res = server.make_request("POST", "/completion", data=data)
+        assert res.status_code == 200
+        assert res.body["content"] == content
+    assert res.body["timings"]["draft_n"] > 0
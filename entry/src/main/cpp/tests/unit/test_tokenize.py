@@ -57,3 +57,16 @@ def test_tokenize_with_pieces():
         assert token["id"] > 0
         assert "piece" in token
         assert len(token["piece"]) > 0
+
+
+@pytest.mark.parametrize("path,data", [
+    ("/detokenize", {"tokens": [1, -1]}),
+    ("/detokenize", {"tokens": [1, 1000000]}),
+    ("/tokenize", {"content": [1, 1000000], "with_pieces": True}),
+])
+def test_invalid_token(path: str, data: dict):
+    global server
+    server.start()
+    res = server.make_request("POST", path, data=data)
+    assert res.status_code == 400
+    assert "invalid token" in res.body["error"]["message"]
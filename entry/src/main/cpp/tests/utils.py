@@ -58,6 +58,8 @@ class ServerProcess:
     n_predict: int | None = None
     n_prompts: int | None = 0
     slot_save_path: str | None = None
+    slot_cache_path: str | None = None
+    lookup_cache_dynamic: str | None = None
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
@@ -73,7 +75,9 @@ class ServerProcess:
     lora_files: List[str] | None = None
     disable_ctx_shift: int | None = False
     draft_min: int | None = None
+    draft_tree: int | None = None
     draft_max: int | None = None
+    prefill_budget: int | None = None
     no_webui: bool | None = None
     chat_template: str | None = None
 
@@ -147,6 +151,10 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.slot_cache_path:
+            server_args.extend(["--slot-cache-path", self.slot_cache_path])
+        if self.lookup_cache_dynamic:
+            server_args.extend(["--lookup-cache-dynamic", self.lookup_cache_dynamic])
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
@@ -164,6 +172,10 @@ class ServerProcess:
             server_args.extend(["--draft-max", self.draft_max])
         if self.draft_min:
             server_args.extend(["--draft-min", self.draft_min])
+        if self.draft_tree:
+            server_args.extend(["--draft-tree", self.draft_tree])
+        if self.prefill_budget:
+            server_args.extend(["--prefill-budget", self.prefill_budget])
         if self.no_webui:
             server_args.append("--no-webui")
         if self.chat_template:
@@ -374,6 +386,25 @@ def parallel_function_calls(function_list: List[Tuple[Callable[..., Any], Tuple[
     return results
 
 
+def assert_parallel_matches_single(server: ServerProcess, path: str, data_list: List[dict]) -> List[ServerResponse]:
+    """
+    Send each request alone, then all of them in parallel, and check that each gives the same content both times.
+    Request i is pinned to slot i, so that the parallel requests are decoded in the same batches.
+    Returns the responses of the single requests.
+    """
+    data_list = [{**data, "id_slot": i} for i, data in enumerate(data_list)]
+
+    res_single = [server.make_request("POST", path, data=data) for data in data_list]
+    assert all([res.status_code == 200 for res in res_single])
+
+    results = parallel_function_calls([(server.make_request, ("POST", path, data)) for data in data_list])
+    assert all([res.status_code == 200 for res in results])
+    for res, ref in zip(results, res_single):
+        assert res.body["content"] == ref.body["content"]
+
+    return res_single
+
+
 def match_regex(regex: str, text: str) -> bool:
     return (
         re.compile(
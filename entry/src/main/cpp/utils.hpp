@@ -17,11 +17,26 @@
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo"
 
@@ -226,6 +241,41 @@ static size_t validate_utf8(const std::string& text) {
     return len;
 }
 
+// incremental version of validate_utf8() for a text that is only appended to
+// pos must be a value returned by a previous call (or 0), only the bytes after it are scanned
+// invalid bytes are taken as characters of their own, so that they do not hold back the rest of the text
+static size_t validate_utf8(std::string_view text, size_t pos) {
+    const size_t len = text.size();
+
+    while (pos < len) {
+        const unsigned char c = text[pos];
+
+        size_t n = 1;
+        if ((c & 0xE0) == 0xC0) {
+            n = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 4;
+        }
+
+        size_t i = 1;
+        while (i < n && pos + i < len && (text[pos + i] & 0xC0) == 0x80) {
+            i++;
+        }
+
+        if (i < n && pos + i == len) {
+            // cut off at the end of the text
+            break;
+        }
+
+        // a sequence cut short by another character is invalid, its lead byte is passed on alone
+        pos += i < n ? 1 : n;
+    }
+
+    return pos;
+}
+
 //
 // template utils
 //
@@ -478,32 +528,484 @@ static bool ends_with(const std::string & str, const std::string & suffix) {
     return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
 }
 
-static size_t find_partial_stop_string(const std::string &stop, const std::string &text) {
-    if (!text.empty() && !stop.empty()) {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
-            if (stop[char_index] == text_last_char) {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial)) {
-                    return text.size() - char_index - 1;
+// streaming Aho-Corasick automaton over the bytes of a set of stop strings
+// the text is fed incrementally: each byte is consumed once, in amortized O(1), and the text itself is not kept
+// the text can only be appended to - any other modification requires reset() and feeding it again
+struct stop_string_matcher {
+    struct state {
+        int32_t depth = 0;  // length of the prefix of the stop strings that leads to this state
+        int32_t fail  = 0;  // the state of the longest proper suffix of this prefix
+        int32_t word  = -1; // index of the stop string that ends in this state, -1 if none
+        int32_t dict  = -1; // the closest state on the fail chain where a stop string ends, -1 if none
+
+        std::vector<std::pair<uint8_t, int32_t>> next;
+    };
+
+    std::vector<state> states = { state() };
+
+    int32_t cur = 0;
+    size_t  n   = 0; // number of fed bytes
+
+    void init(const std::vector<std::string> & words) {
+        states.assign(1, state());
+
+        for (size_t w = 0; w < words.size(); ++w) {
+            int32_t v = 0;
+            for (const char c : words[w]) {
+                int32_t u = child(v, (uint8_t) c);
+                if (u == -1) {
+                    u = states.size();
+                    states.emplace_back();
+                    states[u].depth = states[v].depth + 1;
+                    states[v].next.push_back({ (uint8_t) c, u });
                 }
+                v = u;
             }
+            if (v != 0 && states[v].word == -1) {
+                states[v].word = w;
+            }
+        }
+
+        // breadth-first, so that the fail state of a state is done before it
+        std::vector<int32_t> queue;
+        queue.reserve(states.size());
+        for (const auto & e : states[0].next) {
+            queue.push_back(e.second);
         }
+
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const int32_t v = queue[i];
+            for (const auto & e : states[v].next) {
+                const int32_t u = e.second;
+                states[u].fail = step(states[v].fail, e.first);
+                states[u].dict = states[states[u].fail].word != -1 ? states[u].fail : states[states[u].fail].dict;
+                queue.push_back(u);
+            }
+        }
+
+        reset();
     }
 
-    return std::string::npos;
-}
+    void reset() {
+        cur = 0;
+        n   = 0;
+    }
 
-// TODO: reuse llama_detokenize
-template <class Iter>
-static std::string tokens_to_str(llama_context * ctx, Iter begin, Iter end) {
-    std::string ret;
-    for (; begin != end; ++begin) {
-        ret += common_token_to_piece(ctx, *begin);
+    bool empty() const {
+        return states.size() == 1;
     }
 
-    return ret;
-}
+    // feed the bytes of text after the ones fed so far, and return the position in text of the earliest stop string
+    // that ends in them and starts at pos_min or after, or std::string::npos
+    // of the stop strings at that position, word is set to the first one
+    size_t feed(const std::string & text, size_t pos_min, int32_t & word) {
+        size_t best = std::string::npos;
+
+        for (; n < text.size(); ++n) {
+            cur = step(cur, (uint8_t) text[n]);
+
+            for (int32_t v = states[cur].word != -1 ? cur : states[cur].dict; v != -1; v = states[v].dict) {
+                const size_t pos = n + 1 - states[v].depth;
+                if (pos >= pos_min && (pos < best || (pos == best && states[v].word < word))) {
+                    best = pos;
+                    word = states[v].word;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    // position of the longest suffix of the fed text that is a prefix of a stop string and starts at pos_min or
+    // after, or std::string::npos
+    size_t find_partial(size_t pos_min) const {
+        int32_t v = cur;
+        while (v != 0 && (size_t) states[v].depth > n - std::min(n, pos_min)) {
+            v = states[v].fail;
+        }
+
+        return v != 0 ? n - states[v].depth : std::string::npos;
+    }
+
+private:
+    int32_t child(int32_t v, uint8_t c) const {
+        for (const auto & e : states[v].next) {
+            if (e.first == c) {
+                return e.second;
+            }
+        }
+        return -1;
+    }
+
+    int32_t step(int32_t v, uint8_t c) const {
+        while (true) {
+            const int32_t u = child(v, c);
+            if (u != -1) {
+                return u;
+            }
+            if (v == 0) {
+                return 0;
+            }
+            v = states[v].fail;
+        }
+    }
+};
+
+// incremental suffix automaton over a token sequence
+// lcs() returns the same value as common_lcs(tokens, b), but in O(b.size()) instead of O(tokens.size() * b.size())
+// tokens can only be appended - any other modification of the indexed sequence requires clear() and a rebuild
+struct token_suffix_automaton {
+    struct state {
+        int32_t len  = 0;
+        int32_t link = -1;
+
+        std::unordered_map<llama_token, int32_t> next;
+    };
+
+    std::vector<state> states = { state() };
+
+    int32_t last = 0;
+    size_t  n    = 0; // number of indexed tokens
+
+    size_t size() const {
+        return n;
+    }
+
+    void clear() {
+        states.assign(1, state());
+        last = 0;
+        n    = 0;
+    }
+
+    // amortized O(1)
+    void push_back(llama_token t) {
+        const int32_t cur = states.size();
+        states.emplace_back();
+        states[cur].len = states[last].len + 1;
+
+        int32_t p = last;
+        while (p != -1 && states[p].next.find(t) == states[p].next.end()) {
+            states[p].next[t] = cur;
+            p = states[p].link;
+        }
+
+        if (p == -1) {
+            states[cur].link = 0;
+        } else {
+            const int32_t q = states[p].next[t];
+            if (states[p].len + 1 == states[q].len) {
+                states[cur].link = q;
+            } else {
+                const int32_t clone = states.size();
+                states.push_back(states[q]);
+                states[clone].len = states[p].len + 1;
+
+                while (p != -1) {
+                    auto it = states[p].next.find(t);
+                    if (it == states[p].next.end() || it->second != q) {
+                        break;
+                    }
+                    it->second = clone;
+                    p = states[p].link;
+                }
+
+                states[q].link   = clone;
+                states[cur].link = clone;
+            }
+        }
+
+        last = cur;
+        n++;
+    }
+
+    // length of the longest common contiguous subsequence of the indexed tokens and b
+    size_t lcs(const llama_tokens & b) const {
+        size_t best = 0;
+        size_t cur  = 0;
+
+        int32_t v = 0;
+        for (const llama_token t : b) {
+            auto it = states[v].next.find(t);
+            while (v != 0 && it == states[v].next.end()) {
+                v   = states[v].link;
+                cur = states[v].len;
+                it  = states[v].next.find(t);
+            }
+
+            if (it == states[v].next.end()) {
+                cur = 0;
+                continue;
+            }
+
+            v = it->second;
+            cur++;
+            best = std::max(best, cur);
+        }
+
+        return best;
+    }
+};
+
+// bounded lock-free multi-producer / single-consumer queue (based on the bounded MPMC queue by D. Vyukov)
+// each cell has a sequence number that tells the producers and the consumer whether it is free or filled
+// producers never take a lock, unless the consumer is waiting for new values and has to be woken up
+template <typename T>
+struct mpsc_queue {
+    explicit mpsc_queue(size_t capacity) {
+        size_t n = 1;
+        while (n < capacity) {
+            n <<= 1;
+        }
+
+        cells.reset(new cell[n]);
+        mask = n - 1;
+
+        for (size_t i = 0; i < n; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // returns false if the queue is full, value is only moved from on success
+    bool try_push(T & value) {
+        cell * c;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            c = &cells[pos & mask];
+            const size_t   seq  = c->seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        c->value.emplace(std::move(value));
+        c->seq.store(pos + 1, std::memory_order_seq_cst);
+
+        return true;
+    }
+
+    // if the queue is full, wait for the consumer to make some room
+    void push(T value) {
+        while (!try_push(value)) {
+            notify();
+            std::this_thread::yield();
+        }
+        notify();
+    }
+
+    // consumer only
+    std::optional<T> try_pop() {
+        cell & c = cells[head & mask];
+        if (c.seq.load(std::memory_order_acquire) != head + 1) {
+            return std::nullopt;
+        }
+
+        std::optional<T> res = std::move(c.value);
+        c.value.reset();
+        c.seq.store(head + mask + 1, std::memory_order_release);
+        head++;
+
+        return res;
+    }
+
+    // consumer only
+    bool empty() const {
+        return cells[head & mask].seq.load(std::memory_order_seq_cst) != head + 1;
+    }
+
+    // consumer only: block until a value is pushed or stop() returns true
+    template <typename Pred>
+    void wait(Pred stop) {
+        std::unique_lock<std::mutex> lock(mutex_wait);
+        waiting.store(true, std::memory_order_seq_cst);
+        condition_wait.wait(lock, [&] {
+            return !empty() || stop();
+        });
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+    // wake up the consumer if it is waiting
+    void notify(bool force = false) {
+        if (force || waiting.load(std::memory_order_seq_cst)) {
+            std::unique_lock<std::mutex> lock(mutex_wait);
+            condition_wait.notify_one();
+        }
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        std::optional<T>    value;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> tail = 0; // producers
+    alignas(64) size_t              head = 0; // consumer
+
+    std::atomic<bool> waiting = false;
+
+    std::mutex              mutex_wait;
+    std::condition_variable condition_wait;
+};
+
+// fixed set of threads that run the iterations of a loop in parallel, the calling thread takes part in the work
+// meant for short bursts of independent work from a single thread, e.g. one iteration per slot
+struct parallel_pool {
+    // n_threads includes the calling thread
+    explicit parallel_pool(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back([this] { loop(); });
+        }
+    }
+
+    ~parallel_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        condition_start.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // call fn(i) for i in [0, n), returns when all the calls are done
+    void parallel_for(size_t n, const std::function<void(size_t)> & fn) {
+        if (workers.empty() || n <= 1) {
+            for (size_t i = 0; i < n; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job    = &fn;
+            n_job  = n;
+            i_next = 0;
+            n_busy = workers.size();
+            generation++;
+        }
+        condition_start.notify_all();
+
+        run();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_done.wait(lock, [&] { return n_busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable condition_start;
+    std::condition_variable condition_done;
+
+    const std::function<void(size_t)> * job = nullptr;
+
+    size_t              n_job = 0;
+    std::atomic<size_t> i_next{0};
+
+    size_t   n_busy     = 0;
+    uint64_t generation = 0;
+    bool     stop       = false;
+
+    void run() {
+        size_t i;
+        while ((i = i_next.fetch_add(1)) < n_job) {
+            (*job)(i);
+        }
+    }
+
+    void loop() {
+        uint64_t seen = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition_start.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+            }
+
+            run();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (--n_busy == 0) {
+                    condition_done.notify_one();
+                }
+            }
+        }
+    }
+};
+
+// the text of every token of the vocabulary, in one contiguous arena, built when the server starts
+// alone = false: the output of common_token_to_piece(), alone = true: the output of common_detokenize() for the token
+// alone, which can differ from its piece (e.g. SPM vocabularies remove the leading space of the first token)
+// the table is immutable once built, so that it can be read from any thread
+struct token_piece_table {
+    const bool special;
+    const bool alone;
+
+    token_piece_table(bool special, bool alone) : special(special), alone(alone) {}
+
+    void build(llama_context * ctx) {
+        const int32_t n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+        arena.clear();
+        offsets.resize(n_vocab + 1);
+        offsets[0] = 0;
+
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            arena += alone ? common_detokenize(ctx, {id}, special) : common_token_to_piece(ctx, id, special);
+            offsets[id + 1] = arena.size();
+        }
+
+        arena.shrink_to_fit();
+    }
+
+    bool contains(llama_token token) const {
+        return token >= 0 && (size_t) token + 1 < offsets.size();
+    }
+
+    std::string_view get(llama_token token) const {
+        GGML_ASSERT(contains(token));
+
+        return std::string_view(arena).substr(offsets[token], offsets[token + 1] - offsets[token]);
+    }
+
+    // concatenation of the pieces of the tokens
+    template <class Iter>
+    std::string concat(Iter begin, Iter end) const {
+        std::string ret;
+        for (; begin != end; ++begin) {
+            ret += get(*begin);
+        }
+
+        return ret;
+    }
+
+private:
+    std::string           arena;
+    std::vector<uint32_t> offsets; // n_vocab + 1
+};
 
 // format incomplete utf-8 multibyte character for output
 static std::string tokens_to_output_formatted_string(const llama_context * ctx, const llama_token token) {
@@ -532,6 +1034,116 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+//
+// direct JSON output, for the fixed shapes of the partial results of a stream
+// the output must be byte for byte the same as json::dump() in server_sent_event(): compact, object keys in insertion
+// order (json is an ordered_json), UTF-8 as is, invalid UTF-8 replaced with U+FFFD
+//
+
+// length of the well-formed UTF-8 sequence at the start of str (RFC 3629, as accepted by the nlohmann::json decoder),
+// 0 if it is not well-formed
+static size_t utf8_sequence_len(std::string_view str) {
+    const auto byte = [&](size_t i) -> unsigned char {
+        return i < str.size() ? str[i] : 0;
+    };
+
+    const unsigned char c = byte(0);
+    const auto tail = [&](size_t i) {
+        return (byte(i) & 0xC0) == 0x80;
+    };
+
+    if (c < 0x80) {
+        return 1;
+    }
+    if (c >= 0xC2 && c <= 0xDF) {
+        return tail(1) ? 2 : 0;
+    }
+    if (c >= 0xE0 && c <= 0xEF) {
+        // no overlong encodings and no surrogates
+        const unsigned char lo = c == 0xE0 ? 0xA0 : 0x80;
+        const unsigned char hi = c == 0xED ? 0x9F : 0xBF;
+        return byte(1) >= lo && byte(1) <= hi && tail(2) ? 3 : 0;
+    }
+    if (c >= 0xF0 && c <= 0xF4) {
+        // no overlong encodings and nothing above U+10FFFF
+        const unsigned char lo = c == 0xF0 ? 0x90 : 0x80;
+        const unsigned char hi = c == 0xF4 ? 0x8F : 0xBF;
+        return byte(1) >= lo && byte(1) <= hi && tail(2) && tail(3) ? 4 : 0;
+    }
+
+    return 0;
+}
+
+// append str as a JSON string
+static void json_write_string(std::string & out, std::string_view str) {
+    const size_t n_out = out.size();
+
+    out += '"';
+
+    size_t i_copy = 0; // start of the bytes that are copied as they are
+    for (size_t i = 0; i < str.size();) {
+        const unsigned char c = str[i];
+
+        if (c >= 0x80) {
+            const size_t n = utf8_sequence_len(str.substr(i));
+            if (n == 0) {
+                // the replacement rules of nlohmann::json for invalid UTF-8 are not worth duplicating
+                out.resize(n_out);
+                out += json(std::string(str)).dump(-1, ' ', false, json::error_handler_t::replace);
+                return;
+            }
+            i += n;
+            continue;
+        }
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            i++;
+            continue;
+        }
+
+        out.append(str.data() + i_copy, i - i_copy);
+
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b";  break;
+            case '\f': out += "\\f";  break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } break;
+        }
+
+        i_copy = ++i;
+    }
+
+    out.append(str.data() + i_copy, str.size() - i_copy);
+    out += '"';
+}
+
+static void json_write_int(std::string & out, int64_t value) {
+    char buf[24];
+    const int n = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    out.append(buf, n);
+}
+
+// append j as it is dumped by server_sent_event(), for the parts of a result that are not on the fast path
+static void json_write_value(std::string & out, const json & j) {
+    out += j.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+// write the events in buf, formatted by the caller as server_sent_event() does
+static bool server_sent_events_write(httplib::DataSink & sink, const std::string & buf) {
+    LOG_DBG("data stream, to_send: %s", buf.c_str());
+
+    return sink.write(buf.data(), buf.size());
+}
+
 //
 // OAI utils
 //
@@ -708,7 +1320,7 @@ static json format_response_rerank(const json & request, const json & ranks) {
     return res;
 }
 
-static bool is_valid_utf8(const std::string & str) {
+static bool is_valid_utf8(std::string_view str) {
     const unsigned char* bytes = reinterpret_cast<const unsigned char*>(str.data());
     const unsigned char* end = bytes + str.length();
 
@@ -768,34 +1380,76 @@ static std::string safe_json_to_str(json data) {
     return data.dump(-1, ' ', false, json::error_handler_t::replace);
 }
 
-static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
-    std::vector<llama_token_data> cur;
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+// softmax over the logits, restricted to the n_top most likely tokens
+// the tokens are written to cur sorted by probability, cur is a scratch buffer that can be reused between calls
+// returns the probability of token tok
+// this avoids sorting the whole vocabulary: one pass for the max, one for the sum of exponentials and one that keeps the
+// top tokens in a min-heap, which is rarely touched after the first few thousand tokens
+static float get_token_probabilities(const float * logits, int n_vocab, llama_token tok, size_t n_top, std::vector<llama_token_data> & cur) {
+    float max_l = -INFINITY;
+    {
+        int i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        float32x4_t vmax = vdupq_n_f32(-INFINITY);
+        for (; i + 4 <= n_vocab; i += 4) {
+            vmax = vmaxq_f32(vmax, vld1q_f32(logits + i));
+        }
+        max_l = vmaxvq_f32(vmax);
+#endif
+        for (; i < n_vocab; ++i) {
+            max_l = std::max(max_l, logits[i]);
+        }
+    }
+
+    float cum_sum = 0.0f;
+    {
+        // independent accumulators, so that the exponentials do not wait on each other
+        float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+        int i = 0;
+        for (; i + 4 <= n_vocab; i += 4) {
+            sum[0] += expf(logits[i + 0] - max_l);
+            sum[1] += expf(logits[i + 1] - max_l);
+            sum[2] += expf(logits[i + 2] - max_l);
+            sum[3] += expf(logits[i + 3] - max_l);
+        }
+        for (; i < n_vocab; ++i) {
+            sum[0] += expf(logits[i] - max_l);
+        }
 
-    cur.resize(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        cum_sum = (sum[0] + sum[1]) + (sum[2] + sum[3]);
     }
 
-    // sort tokens by logits
-    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+    n_top = std::min(n_top, (size_t) n_vocab);
+
+    // the front of the heap is the least likely of the top tokens
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
         return a.logit > b.logit;
-    });
+    };
 
-    // apply softmax
-    float max_l = cur[0].logit;
-    float cum_sum = 0.0f;
-    for (size_t i = 0; i < cur.size(); ++i) {
-        float p = expf(cur[i].logit - max_l);
-        cur[i].p = p;
-        cum_sum += p;
+    cur.clear();
+    if (n_top > 0) {
+        cur.reserve(n_top);
+
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            if (cur.size() < n_top) {
+                cur.push_back({token_id, logits[token_id], 0.0f});
+                std::push_heap(cur.begin(), cur.end(), cmp);
+            } else if (logits[token_id] > cur.front().logit) {
+                std::pop_heap(cur.begin(), cur.end(), cmp);
+                cur.back() = {token_id, logits[token_id], 0.0f};
+                std::push_heap(cur.begin(), cur.end(), cmp);
+            }
+        }
+
+        std::sort_heap(cur.begin(), cur.end(), cmp);
     }
-    for (size_t i = 0; i < cur.size(); ++i) {
-        cur[i].p /= cum_sum;
+
+    for (auto & td : cur) {
+        td.p = expf(td.logit - max_l) / cum_sum;
     }
 
-    return cur;
+    return tok >= 0 && tok < n_vocab ? expf(logits[tok] - max_l) / cum_sum : 0.0f;
 }
 
 static bool are_lora_equal(